@@ -0,0 +1,383 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A microbenchmark for the request independent core of mod_cookie2json; see
+// cookie2json_core.h. Every scenario builds a synthetic Cookie header, and
+// then runs it through the same steps respond_with() takes for a request,
+// minus httpd, over and over: parse, filter, dedupe, measure and render into
+// a brigade. For each it reports:
+//
+//   ns/req     the time per request
+//   req/s      the requests per second that makes, on one core
+//   MB/s       the Cookie header bytes per second
+//   arena      the bytes of the scratch arena the request used
+//   pool       the bytes of the body that had to be copied into the request
+//              pool: escaped strings, MessagePack/CBOR headers, and decoded
+//              values that didn't fit in the arena
+//   buckets    the buckets in the response brigade
+//   body       the size of the response
+//
+// Build and run it with 'make bench'. The optional arguments are how long to
+// run each scenario, in seconds (0.25 by default), and the size of the
+// scratch arena (the C2JSONScratchSize default):
+//
+//   $ make bench BENCH_ARGS="1 65536"
+//
+// Compare runs before and after a change on the same machine; the absolute
+// numbers mean little on their own.
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "apr_general.h"
+#include "apr_pools.h"
+
+#include "cookie2json_core.h"
+
+#define BENCH_SCRATCH_SIZE  16384      // the C2JSONScratchSize default
+#define BENCH_BATCH         256        // requests between clock reads
+
+// What the values in the Cookie header look like
+#define VALUES_CLEAN    0       // [0-9a-z], nothing to escape or decode
+#define VALUES_ENCODED  1       // URL encoded, and C2JSONDecode On
+#define VALUES_ESCAPED  2       // with quotes & backslashes, that JSON escapes
+
+typedef struct {
+    const char *name;
+    int pairs;                  // cookies in the header
+    int value_len;              // bytes per value, before encoding
+    int values;                 // VALUES_CLEAN etc
+    int whitelist;              // names on the white list; half of them match
+    int callback;               // JSONP?
+    int duplicates;             // C2JSONDuplicates; every other cookie is sent twice
+                                // unless this is DUPLICATES_ALL
+    int format;                 // FORMAT_JSON etc
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    // name                         pairs value values          list cb dups              format
+    { "tiny",                           2,   16, VALUES_CLEAN,      0, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "typical",                       12,   24, VALUES_CLEAN,      0, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "typical/callback",              12,   24, VALUES_CLEAN,      0, 1, DUPLICATES_ALL,   FORMAT_JSON },
+    { "typical/whitelist-4",           12,   24, VALUES_CLEAN,      4, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "typical/whitelist-64",          12,   24, VALUES_CLEAN,     64, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "typical/whitelist-4/callback",  12,   24, VALUES_CLEAN,      4, 1, DUPLICATES_ALL,   FORMAT_JSON },
+    { "typical/decode",                12,   24, VALUES_ENCODED,    0, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "typical/escaped",               12,   24, VALUES_ESCAPED,    0, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "typical/duplicates-last",       12,   24, VALUES_CLEAN,      0, 0, DUPLICATES_LAST,  FORMAT_JSON },
+    { "typical/duplicates-array",      12,   24, VALUES_CLEAN,      0, 0, DUPLICATES_ARRAY, FORMAT_JSON },
+    { "typical/msgpack",               12,   24, VALUES_CLEAN,      0, 0, DUPLICATES_ALL,   FORMAT_MSGPACK },
+    { "typical/cbor",                  12,   24, VALUES_CLEAN,      0, 0, DUPLICATES_ALL,   FORMAT_CBOR },
+    { "long-values",                    8,  512, VALUES_CLEAN,      0, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "long-values/escaped",            8,  512, VALUES_ESCAPED,    0, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "many",                          64,   24, VALUES_CLEAN,      0, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "many/whitelist-64/callback",    64,   24, VALUES_CLEAN,     64, 1, DUPLICATES_ALL,   FORMAT_JSON },
+    { "huge",                         256,   32, VALUES_CLEAN,      0, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "huge/whitelist-256",           256,   32, VALUES_CLEAN,    256, 0, DUPLICATES_ALL,   FORMAT_JSON },
+    { "huge/duplicates-array",        256,   32, VALUES_CLEAN,      0, 0, DUPLICATES_ARRAY, FORMAT_JSON },
+    { "huge/msgpack",                 256,   32, VALUES_CLEAN,      0, 0, DUPLICATES_ALL,   FORMAT_MSGPACK },
+};
+
+#define CALLBACK        "jQuery_1234567890_callback"
+
+// Everything a scenario needs, built once up front
+typedef struct {
+    const scenario_t *sc;
+    const char *header;
+    apr_size_t header_len;
+    const matcher_list_t *matchers;     // NULL without a white list
+    const char *callback;
+    apr_size_t callback_len;
+} corpus_t;
+
+// What a single request did; see inspect()
+typedef struct {
+    apr_size_t arena;
+    apr_size_t pool;
+    int buckets;
+    apr_size_t body;
+} usage_t;
+
+/* ********************************************
+
+    Corpora
+
+   ******************************************** */
+
+// A value of len bytes, before encoding, for cookie i
+static char *make_value(apr_pool_t *p, int i, int len, int values)
+{
+    static const char alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    char *value = apr_palloc( p, len * 3 + 1 );    // room for %XX escapes
+    char *out   = value;
+    int j;
+
+    for( j = 0; j < len; j++ ) {
+        // every 8th byte is one that needs special treatment
+        if( j % 8 == 7 && values == VALUES_ENCODED ) {
+            memcpy( out, "%2F", 3 );
+            out += 3;
+        } else if( j % 8 == 7 && values == VALUES_ESCAPED ) {
+            *out++ = j % 16 == 7 ? '"' : '\\';
+        } else {
+            *out++ = alphabet[ (i + j) % (sizeof(alphabet) - 1) ];
+        }
+    }
+
+    *out = '\0';
+    return value;
+}
+
+// The Cookie header for a scenario: "c0=...; c1=...", like a browser sends it
+static const char *make_header(apr_pool_t *p, const scenario_t *sc)
+{
+    const char *header = "";
+    int i;
+
+    for( i = 0; i < sc->pairs; i++ ) {
+        const char *value = make_value( p, i, sc->value_len, sc->values );
+
+        header = apr_psprintf( p, "%s%sc%d=%s", header, i ? "; " : "", i, value );
+
+        // the same name again, with a different value, as if set on another path
+        if( sc->duplicates != DUPLICATES_ALL && i % 2 == 0 ) {
+            value  = make_value( p, i + 1, sc->value_len, sc->values );
+            header = apr_psprintf( p, "%s; c%d=%s", header, i, value );
+        }
+    }
+
+    return header;
+}
+
+// A white list of n names, every other one of which is in the header
+static const matcher_list_t *make_whitelist(apr_pool_t *p, int n)
+{
+    apr_array_header_t *names    = apr_array_make( p, n, sizeof(char *) );
+    apr_array_header_t *prefixes = apr_array_make( p, 0, sizeof(char *) );
+    int i;
+
+    for( i = 0; i < n; i++ ) {
+        *(const char **)apr_array_push( names ) =
+            i % 2 ? apr_psprintf( p, "x%d", i ) : apr_psprintf( p, "c%d", i );
+    }
+
+    return compile_matchers( p, prefixes, names );
+}
+
+static void make_corpus(apr_pool_t *p, const scenario_t *sc, corpus_t *corpus)
+{
+    corpus->sc              = sc;
+    corpus->header          = make_header( p, sc );
+    corpus->header_len      = strlen( corpus->header );
+    corpus->matchers        = sc->whitelist ? make_whitelist( p, sc->whitelist ) : NULL;
+    corpus->callback        = sc->callback ? CALLBACK : "";
+    corpus->callback_len    = strlen( corpus->callback );
+}
+
+/* ********************************************
+
+    Requests
+
+   ******************************************** */
+
+// One request, the way respond_with() handles it: the pairs go in the scratch
+// arena, the brigade and whatever it needs come from the request pool.
+// Returns the size of the body, as measured before it was rendered.
+static apr_size_t request(const corpus_t *corpus, scratch_t *sc, apr_pool_t *rp,
+                          apr_bucket_alloc_t *ba, apr_bucket_brigade **out)
+{
+    const scenario_t *s = corpus->sc;
+    apr_array_header_t pairs_on_stack;
+    apr_array_header_t *pairs;
+
+    sc->used     = 0;
+    sc->fallback = rp;
+
+    // a callback is only accepted if it's made of valid characters
+    if( corpus->callback_len &&
+        find_invalid_callback_char( corpus->callback,
+                                    corpus->callback + corpus->callback_len )
+            != corpus->callback + corpus->callback_len
+    ) {
+        fprintf( stderr, "Invalid callback %s\n", corpus->callback );
+        exit( 1 );
+    }
+
+    pairs = scratch_pairs( sc, &pairs_on_stack, corpus->header_len, 0 );
+
+    parse_pairs( corpus->header, corpus->header_len, pairs, 0 );
+
+    // specialized for the white list, like the responders in the module
+    if( corpus->matchers ) {
+        filter_pairs( sc, corpus->matchers, s->values == VALUES_ENCODED, pairs,
+                      NULL, s->format, 1 );
+    } else {
+        filter_pairs( sc, NULL, s->values == VALUES_ENCODED, pairs,
+                      NULL, s->format, 0 );
+    }
+
+    if( s->duplicates != DUPLICATES_ALL ) {
+        dedupe_pairs( sc, s->duplicates, pairs );
+    }
+
+    apr_size_t body_len = measure_response( pairs, s->format, corpus->callback_len );
+
+    apr_bucket_brigade *bb = apr_brigade_create( rp, ba );
+
+    emit_response( bb, pairs, s->format, corpus->callback, corpus->callback_len );
+
+    *out = bb;
+    return body_len;
+}
+
+// Run a single request, and work out what it used. Also checks that the body
+// is exactly as long as it was measured to be, as the module relies on that
+// for the Content-Length.
+static void inspect(const corpus_t *corpus, scratch_t *sc, apr_pool_t *rp,
+                    apr_bucket_alloc_t *ba, usage_t *usage)
+{
+    apr_bucket_brigade *bb;
+    apr_bucket *b;
+    apr_size_t body_len = request( corpus, sc, rp, ba, &bb );
+    const char *header  = corpus->header;
+
+    usage->arena        = sc->used;
+    usage->pool         = 0;
+    usage->buckets      = 0;
+    usage->body         = 0;
+
+    for( b = APR_BRIGADE_FIRST( bb ); b != APR_BRIGADE_SENTINEL( bb ); b = APR_BUCKET_NEXT( b ) ) {
+        const char *data;
+        apr_size_t len;
+
+        apr_bucket_read( b, &data, &len, APR_BLOCK_READ );
+
+        usage->buckets++;
+        usage->body += len;
+
+        // Copies are the transient buckets that point neither into the
+        // request (the header, or the query string for the callback) nor
+        // into the arena; the constant bits are immortal
+        if( APR_BUCKET_IS_TRANSIENT( b ) &&
+            !(data >= header && data < header + corpus->header_len) &&
+            data != corpus->callback &&
+            !(data >= sc->base && data < sc->base + sc->size)
+        ) {
+            usage->pool += len;
+        }
+    }
+
+    if( usage->body != body_len ) {
+        fprintf( stderr, "%s: measured %" APR_SIZE_T_FMT " bytes, but rendered %"
+                         APR_SIZE_T_FMT "\n", corpus->sc->name, body_len, usage->body );
+        exit( 1 );
+    }
+
+    apr_brigade_destroy( bb );
+    apr_pool_clear( rp );
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run requests for at least 'seconds', and return the time per request, in ns
+static double run(const corpus_t *corpus, scratch_t *sc, apr_pool_t *rp,
+                  apr_bucket_alloc_t *ba, double seconds)
+{
+    apr_bucket_brigade *bb;
+    long requests   = 0;
+    double start    = now();
+    double elapsed;
+    int i;
+
+    do {
+        for( i = 0; i < BENCH_BATCH; i++ ) {
+            request( corpus, sc, rp, ba, &bb );
+
+            apr_brigade_destroy( bb );
+            apr_pool_clear( rp );
+        }
+
+        requests += BENCH_BATCH;
+        elapsed   = now() - start;
+
+    } while( elapsed < seconds );
+
+    return elapsed * 1e9 / requests;
+}
+
+int main(int argc, const char *const *argv)
+{
+    double seconds      = argc > 1 ? atof( argv[1] ) : 0.25;
+    apr_size_t size     = argc > 2 ? (apr_size_t)atol( argv[2] ) : BENCH_SCRATCH_SIZE;
+    apr_pool_t *pool, *rp;
+    apr_bucket_alloc_t *ba;
+    scratch_t sc;
+    unsigned int i;
+
+    if( seconds <= 0 ) {
+        fprintf( stderr, "Usage: %s [seconds per scenario [scratch size]]\n", argv[0] );
+        return 2;
+    }
+
+    apr_app_initialize( &argc, &argv, NULL );
+    atexit( apr_terminate );
+
+    apr_pool_create( &pool, NULL );
+    apr_pool_create( &rp, pool );
+
+    // like a connection: one bucket allocator and one arena for all requests
+    ba          = apr_bucket_alloc_create( pool );
+    sc.size     = size;
+    sc.base     = size ? apr_palloc( pool, size ) : NULL;
+    sc.used     = 0;
+    sc.fallback = rp;
+
+    select_scanners();
+
+    printf( "%-30s %7s %5s %9s %11s %8s %7s %7s %7s %7s\n",
+            "scenario", "header", "pairs", "ns/req", "req/s", "MB/s",
+            "arena", "pool", "buckets", "body" );
+
+    for( i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++ ) {
+        corpus_t corpus;
+        usage_t usage;
+
+        make_corpus( pool, &scenarios[i], &corpus );
+
+        inspect( &corpus, &sc, rp, ba, &usage );
+
+        double ns = run( &corpus, &sc, rp, ba, seconds );
+
+        printf( "%-30s %7" APR_SIZE_T_FMT " %5d %9.1f %11.0f %8.1f %7" APR_SIZE_T_FMT
+                " %7" APR_SIZE_T_FMT " %7d %7" APR_SIZE_T_FMT "\n",
+                corpus.sc->name, corpus.header_len, corpus.sc->pairs, ns, 1e9 / ns,
+                corpus.header_len * 1e3 / ns, usage.arena, usage.pool,
+                usage.buckets, usage.body );
+
+        fflush( stdout );
+    }
+
+    apr_pool_destroy( pool );
+
+    return 0;
+}
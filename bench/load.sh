@@ -0,0 +1,145 @@
+#!/bin/sh
+#
+# End to end load test: runs the test server (test/httpd.conf) under each of
+# the event, worker and prefork MPMs in turn, and puts a few of its locations
+# under load with wrk, or with ab if wrk isn't installed. For every MPM and
+# location it reports the requests per second, and the 50th and 99th
+# percentile latency in milliseconds.
+#
+# Build the module first (perl build.pl), and run this from the checkout
+# directory, like test/run_httpd.sh:
+#
+#   $ ./bench/load.sh
+#
+# Or 'make load'. Compare runs on the same machine; the absolute numbers
+# mean little on their own. Settings, from the environment:
+#
+#   MPMS            the MPMs to try              (event worker prefork)
+#   ENDPOINTS       the locations to request     (basic whitelist ...)
+#   COOKIE          the Cookie header to send    (16 cookies)
+#   CONCURRENCY     connections at once          (32)
+#   DURATION        seconds per run, with wrk    (10)
+#   REQUESTS        requests per run, with ab    (100000)
+
+MPMS=${MPMS:-"event worker prefork"}
+ENDPOINTS=${ENDPOINTS:-"basic whitelist callback?callback=cb early cache decode format"}
+CONCURRENCY=${CONCURRENCY:-32}
+DURATION=${DURATION:-10}
+REQUESTS=${REQUESTS:-100000}
+BASE="http://localhost:7000"
+
+if [ -z "$COOKIE" ]; then
+    COOKIE="a=1; b=2; c=3"
+    for i in 1 2 3 4 5 6 7 8 9 10 11 12 13; do
+        COOKIE="$COOKIE; cookie$i=value$i%20with%20some%20padding"
+    done
+fi
+
+if [ -x /usr/sbin/apache2ctl ];
+then
+    CMD="/usr/sbin/apache2ctl"
+else if [ -x /usr/sbin/apachectl ];
+then
+    CMD="/usr/sbin/apachectl"
+else
+    CMD="apache2ctl"
+fi
+fi
+
+if command -v wrk >/dev/null 2>&1; then
+    TOOL=wrk
+else if command -v ab >/dev/null 2>&1; then
+    TOOL=ab
+else
+    echo "Could not find wrk or ab in your path."
+    echo "On Ubuntu/Debian, try 'sudo apt-get install wrk' or 'sudo apt-get install apache2-utils'"
+    exit 1
+fi
+fi
+
+if [ ! -f .libs/mod_cookie2json.so ]; then
+    echo "Build the module first: perl build.pl"
+    exit 1
+fi
+
+DIR=`pwd`
+CONF="$DIR/test/load.conf"
+
+trap 'rm -f "$CONF"' EXIT
+
+# Wait (up to 10 seconds) until httpd is (1) or is no longer (0) running
+wait_for() {
+    want=$1
+    tries=0
+
+    while [ $tries -lt 50 ]; do
+        if [ -f test/httpd.pid ] && kill -0 `cat test/httpd.pid` 2>/dev/null; then
+            up=1
+        else
+            up=0
+        fi
+
+        [ $up = $want ] && return 0
+
+        sleep 0.2
+        tries=$((tries + 1))
+    done
+
+    return 1
+}
+
+# Prints "requests/second p50 p99" for a single run against a URL
+run() {
+    if [ $TOOL = wrk ]; then
+        wrk -t 2 -c $CONCURRENCY -d ${DURATION}s --latency -H "Cookie: $COOKIE" "$1" |
+        awk '
+            # latencies are printed with a unit; convert them to ms
+            function ms(v) {
+                if( v ~ /us$/ ) return v / 1000;
+                if( v ~ /ms$/ ) return v + 0;
+                if( v ~ /s$/  ) return v * 1000;
+                return v;
+            }
+            /Requests\/sec:/    { rps = $2 }
+            $1 == "50%"         { p50 = ms($2) }
+            $1 == "99%"         { p99 = ms($2) }
+            END                 { printf "%.0f %.2f %.2f\n", rps, p50, p99 }
+        '
+    else
+        # ab rounds the percentiles to whole milliseconds
+        ab -q -k -n $REQUESTS -c $CONCURRENCY -H "Cookie: $COOKIE" "$1" |
+        awk '
+            /Requests per second:/  { rps = $4 }
+            $1 == "50%"             { p50 = $2 }
+            $1 == "99%"             { p99 = $2 }
+            END                     { printf "%.0f %.2f %.2f\n", rps, p50, p99 }
+        '
+    fi
+}
+
+echo "Using $TOOL, $CONCURRENCY connections"
+echo
+printf "%-10s %-28s %10s %10s %10s\n" "mpm" "endpoint" "req/s" "p50 ms" "p99 ms"
+
+for mpm in $MPMS; do
+    # the test config, with the MPM swapped
+    sed -e "s/mod_mpm_event\.so/mod_mpm_$mpm.so/" \
+        -e "s/mpm_event_module/mpm_${mpm}_module/" \
+        test/httpd.conf > "$CONF"
+
+    $CMD -d "$DIR" -f "$CONF" -k start
+
+    if ! wait_for 1; then
+        echo "Could not start httpd with the $mpm MPM; see test/error.log"
+        exit 1
+    fi
+
+    for endpoint in $ENDPOINTS; do
+        set -- `run "$BASE/$endpoint"`
+
+        printf "%-10s %-28s %10s %10s %10s\n" $mpm "/$endpoint" "$1" "$2" "$3"
+    done
+
+    $CMD -d "$DIR" -f "$CONF" -k stop
+    wait_for 0
+done
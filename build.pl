@@ -11,7 +11,7 @@ my $debug   = 0;
 my $install = 0;
 my $apxs    = 'apxs2';
 my @flags   = do { no warnings; qw[-a -c -Wl,-Wall -Wl,-lm]; };
-my $my_lib  = 'mod_cookie2json.c';
+my @my_lib  = qw[mod_cookie2json.c cookie2json_core.c];
 my @inc;
 my @link;
 
@@ -49,7 +49,7 @@ push @cmd, map { "-Wl,-l$_" } @link;
 push @cmd, "-Wc,-DDEBUG" if $debug;
 
 ### our module
-push @cmd, $my_lib;
+push @cmd, @my_lib;
 
 
 warn "\n\nAbout to run:\n\t@cmd\n\n";
@@ -0,0 +1,1434 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The parts of mod_cookie2json that don't need a request: tokenizing the
+// Cookie header, filtering, escaping and rendering the pairs. Only APR and
+// APR-util are used here, no httpd, so bench/bench.c can run this as is.
+// See cookie2json_core.h
+
+#define APR_WANT_STRFUNC
+#include "apr_want.h"
+
+#include "cookie2json_core.h"
+
+// Vectorized scanning, see 'Byte scanning' below. SSE2 is part of the x86-64
+// baseline; AVX2 needs a compiler that allows target specific intrinsics in
+// functions marked with __attribute__((target)), and is picked at runtime.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define C2JSON_HAVE_SSE2 1
+#include <emmintrin.h>
+#if defined(__clang__) || __GNUC__ >= 5
+#define C2JSON_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+
+
+/* ********************************************
+
+    Byte scanning
+
+   ******************************************** */
+
+// mapping from ascii position to T/F allows [.0-9A-Z_a-z] see: http://www.asciitable.com/
+static const char valid_callback_char_table[] = {
+        // null to -
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0,
+
+        1, // .
+        0, // /
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0-9
+        0, 0, 0, 0, 0, 0, 0, // : to @
+
+        // A - Z
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1,
+
+        0, 0, 0, 0, // [ to ^
+        1, // _
+        0, // `
+
+        // a - z
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1,
+
+        // ( to the end
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0
+};
+
+// mapping from byte value to how it has to be written inside a JSON string:
+// 0 means as is, 'u' means as \u00XX, anything else is the character to put
+// after a backslash. 0xE2 is marked '?'; it may start U+2028 or U+2029, which
+// are valid JSON but end a string literal in JavaScript, so they're escaped too.
+static const char json_escape_table[256] = {
+        // control characters
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+        'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+
+        0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // space to /
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0 to ?
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // @ to O
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0, // P to _
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // ` to o
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // p to DEL
+
+        // 0x80 to the end
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, '?', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xE0 to 0xEF
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// The parser spends nearly all of its time looking for the next structural
+// byte (';', ',', '=', '&') in a long header. These functions find the first
+// occurrence of any of (up to) three bytes in [p, end) and return a pointer to
+// it, or end if there is none. Pass the same byte more than once to look for
+// fewer. There's a portable version, and SSE2/AVX2 versions that check 16/32
+// bytes at a time; select_scanners() picks the best one the CPU supports.
+static const char *find_any_scalar( const char *p, const char *end,
+                                    char a, char b, char c )
+{
+    for( ; p < end; p++ ) {
+        if( *p == a || *p == b || *p == c ) {
+            break;
+        }
+    }
+
+    return p;
+}
+
+#ifdef C2JSON_HAVE_SSE2
+__attribute__((target("sse2")))
+static const char *find_any_sse2( const char *p, const char *end,
+                                  char a, char b, char c )
+{
+    const __m128i va = _mm_set1_epi8( a );
+    const __m128i vb = _mm_set1_epi8( b );
+    const __m128i vc = _mm_set1_epi8( c );
+
+    for( ; end - p >= 16; p += 16 ) {
+        __m128i chunk = _mm_loadu_si128( (const __m128i *)p );
+        int mask      = _mm_movemask_epi8( _mm_or_si128(
+                            _mm_or_si128( _mm_cmpeq_epi8( chunk, va ),
+                                          _mm_cmpeq_epi8( chunk, vb ) ),
+                            _mm_cmpeq_epi8( chunk, vc ) ) );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    return find_any_scalar( p, end, a, b, c );
+}
+#endif
+
+#ifdef C2JSON_HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *find_any_avx2( const char *p, const char *end,
+                                  char a, char b, char c )
+{
+    const __m256i va = _mm256_set1_epi8( a );
+    const __m256i vb = _mm256_set1_epi8( b );
+    const __m256i vc = _mm256_set1_epi8( c );
+
+    for( ; end - p >= 32; p += 32 ) {
+        __m256i chunk = _mm256_loadu_si256( (const __m256i *)p );
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8( _mm256_or_si256(
+                            _mm256_or_si256( _mm256_cmpeq_epi8( chunk, va ),
+                                             _mm256_cmpeq_epi8( chunk, vb ) ),
+                            _mm256_cmpeq_epi8( chunk, vc ) ) );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    return find_any_sse2( p, end, a, b, c );
+}
+#endif
+
+// Scanners for a fixed class of bytes; they return the first byte in [p, end)
+// that is in the class, or end if there is none.
+// Find the first byte in [p, end) that is NOT allowed in a callback name, as
+// per valid_callback_char_table, or end if they're all fine.
+
+static const char *find_invalid_callback_char_scalar( const char *p, const char *end )
+{
+    while( p < end && valid_callback_char_table[(unsigned char)*p] ) {
+        p++;
+    }
+
+    return p;
+}
+
+#ifdef C2JSON_HAVE_SSE2
+// SSE2 only has signed byte compares, so to test lo <= x <= hi we shift the
+// range down to start at -128 and do a single 'less than' instead.
+#define SSE2_IN_RANGE(x, lo, hi) \
+    _mm_cmplt_epi8( _mm_add_epi8( (x), _mm_set1_epi8( (char)(0x80 - (lo)) ) ), \
+                    _mm_set1_epi8( (char)(0x80 + ((hi) - (lo)) + 1) ) )
+
+__attribute__((target("sse2")))
+static const char *find_invalid_callback_char_sse2( const char *p, const char *end )
+{
+    for( ; end - p >= 16; p += 16 ) {
+        __m128i chunk = _mm_loadu_si128( (const __m128i *)p );
+
+        // [.0-9A-Z_a-z]; fold the letters to lower case with | 0x20 first
+        __m128i valid = _mm_or_si128(
+            _mm_or_si128( SSE2_IN_RANGE( chunk, '0', '9' ),
+                          SSE2_IN_RANGE( _mm_or_si128( chunk, _mm_set1_epi8( 0x20 ) ), 'a', 'z' ) ),
+            _mm_or_si128( _mm_cmpeq_epi8( chunk, _mm_set1_epi8( '.' ) ),
+                          _mm_cmpeq_epi8( chunk, _mm_set1_epi8( '_' ) ) ) );
+
+        int mask = _mm_movemask_epi8( valid ) ^ 0xFFFF;
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    return find_invalid_callback_char_scalar( p, end );
+}
+#endif
+
+// Find the first byte in [p, end) that json_escape_table says needs a closer
+// look, or end if the whole range can be copied into a JSON string as is.
+static const char *find_json_special_scalar( const char *p, const char *end )
+{
+    while( p < end && !json_escape_table[(unsigned char)*p] ) {
+        p++;
+    }
+
+    return p;
+}
+
+#ifdef C2JSON_HAVE_SSE2
+__attribute__((target("sse2")))
+static const char *find_json_special_sse2( const char *p, const char *end )
+{
+    for( ; end - p >= 16; p += 16 ) {
+        __m128i chunk = _mm_loadu_si128( (const __m128i *)p );
+
+        // control characters are exactly the bytes with none of the top 3 bits set
+        __m128i special = _mm_or_si128(
+            _mm_or_si128( _mm_cmpeq_epi8( _mm_and_si128( chunk, _mm_set1_epi8( (char)0xE0 ) ),
+                                          _mm_setzero_si128() ),
+                          _mm_cmpeq_epi8( chunk, _mm_set1_epi8( (char)0xE2 ) ) ),
+            _mm_or_si128( _mm_cmpeq_epi8( chunk, _mm_set1_epi8( '"' ) ),
+                          _mm_cmpeq_epi8( chunk, _mm_set1_epi8( '\\' ) ) ) );
+
+        int mask = _mm_movemask_epi8( special );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    return find_json_special_scalar( p, end );
+}
+#endif
+
+#ifdef C2JSON_HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *find_json_special_avx2( const char *p, const char *end )
+{
+    for( ; end - p >= 32; p += 32 ) {
+        __m256i chunk = _mm256_loadu_si256( (const __m256i *)p );
+
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256( _mm256_cmpeq_epi8( _mm256_and_si256( chunk, _mm256_set1_epi8( (char)0xE0 ) ),
+                                                _mm256_setzero_si256() ),
+                             _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( (char)0xE2 ) ) ),
+            _mm256_or_si256( _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( '"' ) ),
+                             _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( '\\' ) ) ) );
+
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8( special );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    return find_json_special_sse2( p, end );
+}
+#endif
+
+// Find the first byte in [p, end) that isn't 7 bit ASCII, or end if there is
+// none. Only those need a closer look to tell whether a string is valid UTF-8.
+static const char *find_non_ascii_scalar( const char *p, const char *end )
+{
+    while( p < end && !(*p & 0x80) ) {
+        p++;
+    }
+
+    return p;
+}
+
+#ifdef C2JSON_HAVE_SSE2
+__attribute__((target("sse2")))
+static const char *find_non_ascii_sse2( const char *p, const char *end )
+{
+    for( ; end - p >= 16; p += 16 ) {
+        // the top bit of every byte is exactly what movemask collects
+        int mask = _mm_movemask_epi8( _mm_loadu_si128( (const __m128i *)p ) );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    return find_non_ascii_scalar( p, end );
+}
+#endif
+
+#ifdef C2JSON_HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *find_non_ascii_avx2( const char *p, const char *end )
+{
+    for( ; end - p >= 32; p += 32 ) {
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+                                _mm256_loadu_si256( (const __m256i *)p ) );
+        if( mask ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    return find_non_ascii_sse2( p, end );
+}
+#endif
+
+// The scanners in use; the portable ones until select_scanners() has run
+find_any_fn  find_any                   = find_any_scalar;
+find_byte_fn find_invalid_callback_char = find_invalid_callback_char_scalar;
+find_byte_fn find_json_special          = find_json_special_scalar;
+find_byte_fn find_non_ascii             = find_non_ascii_scalar;
+
+// Pick the fastest implementations this CPU supports. Called once, when the
+// module is loaded, before any requests are served.
+void select_scanners( void )
+{
+#ifdef C2JSON_HAVE_SSE2
+    __builtin_cpu_init();
+
+    if( __builtin_cpu_supports( "sse2" ) ) {
+        find_any                    = find_any_sse2;
+        find_invalid_callback_char  = find_invalid_callback_char_sse2;
+        find_json_special           = find_json_special_sse2;
+        find_non_ascii              = find_non_ascii_sse2;
+    }
+#endif
+
+#ifdef C2JSON_HAVE_AVX2
+    if( __builtin_cpu_supports( "avx2" ) ) {
+        find_any                    = find_any_avx2;
+        find_json_special           = find_json_special_avx2;
+        find_non_ascii              = find_non_ascii_avx2;
+    }
+#endif
+
+    _DEBUG && fprintf( stderr, "using %s scanners\n",
+                        find_any == find_any_scalar ? "scalar" : "vectorized" );
+}
+
+/* ********************************************
+
+    Cookie header tokenizer
+
+   ******************************************** */
+
+// Find the next well formed key=value pair in a Cookie header, starting at
+// *cursor and stopping at end, and advance *cursor past it. Returns 1 if a pair was found, and 0
+// once the header is exhausted.
+//
+// If the client sent a single cookie header with multiple values, they will be
+// split by a ; For example:
+//   Cookie: a=1; b=2
+// However, if the client sent multiple cookie headers, with a single value
+// each, they'll be split by a , For example:
+//   Cookie: a=1, b=2
+// A combination of the above is also possible, so we might receive a string
+// like: a=1, b=2; c=3
+// Both separators are treated the same, and leading whitespace is dropped from
+// every pair. Pairs that are empty, have no = sign, or start with a = sign are
+// garbage and silently skipped. The value is everything after the first = up
+// to the next separator, trailing whitespace included.
+static int next_cookie_pair( const char **cursor, const char *end,
+                             cookie_pair_t *pair )
+{
+    const char *p = *cursor;
+
+    while( p < end ) {
+
+        // Skip separators and leading whitespace; that also takes care of
+        // empty pairs like 'a=1;; b=2' or 'a=1, , b=2'
+        if( *p == ',' || *p == ';' || apr_isspace(*p) ) {
+            p++;
+            continue;
+        }
+
+        // This is the start of a pair. The first structural character after
+        // it tells us what kind of pair this is.
+        const char *start  = p;
+        const char *equals = find_any( p, end, '=', ';', ',' );
+
+        // Does not contain a =, meaning it's garbage. Carry on from the
+        // separator (or the end of the header)
+        if( equals == end || *equals != '=' ) {
+            p = equals;
+            continue;
+        }
+
+        // The value is everything up to the next separator, including any
+        // more = signs.
+        p = find_any( equals + 1, end, ';', ',', ',' );
+
+        // Starts with a =, meaning it's garbage
+        if( equals == start ) {
+            continue;
+        }
+
+        pair->key       = start;
+        pair->key_len   = equals - start;
+        pair->value     = equals + 1;
+        pair->value_len = p - (equals + 1);
+
+        *cursor = p;
+        return 1;
+    }
+
+    *cursor = p;
+    return 0;
+}
+
+/* ********************************************
+
+    Prefix & name matching
+
+   ******************************************** */
+
+// Compile a list of prefixes and a list of exact names into a single DFA that
+// matches case insensitively. This runs at config time, so it favours a simple
+// build over a small one. Returns NULL if both lists are empty.
+static matcher_t *compile_matcher( apr_pool_t *pool,
+                                   const apr_array_header_t *prefixes,
+                                   const apr_array_header_t *names )
+{
+    const apr_array_header_t *lists[] = { prefixes, names };
+    const int flags[]                 = { MATCH_PREFIX, MATCH_EXACT };
+    apr_size_t max_states             = 2;  // the 'no match' and start states
+    int l, i;
+
+    if( apr_is_empty_array( prefixes ) && apr_is_empty_array( names ) ) {
+        return NULL;
+    }
+
+    matcher_t *m = apr_pcalloc( pool, sizeof(matcher_t) );
+
+    // First, fold the alphabet: every (case folded) byte that appears in any
+    // entry gets its own column, everything else shares column 0, which never
+    // leads anywhere. That keeps the transition table small.
+    m->nclasses = 1;
+
+    for( l = 0; l < 2; l++ ) {
+        for( i = 0; lists[l] && i < lists[l]->nelts; i++ ) {
+            const unsigned char *c = ((const unsigned char **)lists[l]->elts)[i];
+
+            for( ; *c; c++, max_states++ ) {
+                if( !m->byte_class[ apr_tolower(*c) ] ) {
+                    m->byte_class[ apr_tolower(*c) ] = m->nclasses;
+                    m->byte_class[ apr_toupper(*c) ] = m->nclasses;
+                    m->nclasses++;
+                }
+            }
+        }
+    }
+
+    // Then build the trie. Worst case every byte of every entry is a new state;
+    // set_config_value() makes sure that fits in an apr_uint16_t.
+    m->next     = apr_pcalloc( pool, max_states * m->nclasses * sizeof(apr_uint16_t) );
+    m->accept   = apr_pcalloc( pool, max_states );
+    m->nstates  = 2;
+
+    for( l = 0; l < 2; l++ ) {
+        for( i = 0; lists[l] && i < lists[l]->nelts; i++ ) {
+            const unsigned char *c = ((const unsigned char **)lists[l]->elts)[i];
+            int state              = 1;
+
+            for( ; *c; c++ ) {
+                apr_uint16_t *next = &m->next[ state * m->nclasses + m->byte_class[*c] ];
+
+                if( !*next ) {
+                    *next = m->nstates++;
+                }
+
+                state = *next;
+            }
+
+            m->accept[state] |= flags[l];
+        }
+    }
+
+    return m;
+}
+
+// Does str (of len bytes, not NUL terminated) start with one of the prefixes,
+// or is it exactly one of the names, the matcher was compiled from?
+static int matcher_match( const matcher_t *m, const char *str, apr_size_t len )
+{
+    const unsigned char *c   = (const unsigned char *)str;
+    const unsigned char *end = c + len;
+    int state                = 1;
+
+    for( ; c < end; c++ ) {
+        state = m->next[ state * m->nclasses + m->byte_class[*c] ];
+
+        // Nothing in the list continues like this
+        if( !state ) {
+            return 0;
+        }
+
+        // we just consumed a whole prefix; whatever follows is fine
+        if( m->accept[state] & MATCH_PREFIX ) {
+            return 1;
+        }
+    }
+
+    return m->accept[state] & MATCH_EXACT;
+}
+
+// Does str (of len bytes) match any of the matchers in the list?
+int matchers_match( const matcher_list_t *list, const char *str, apr_size_t len )
+{
+    for( ; list; list = list->next ) {
+        if( matcher_match( list->matcher, str, len ) ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Chain the matchers in 'first' and 'then' together, copying only the links
+// of 'first'. Either can be NULL.
+const matcher_list_t *chain_matchers( apr_pool_t *pool,
+                                      const matcher_list_t *first,
+                                      const matcher_list_t *then )
+{
+    if( !first ) {
+        return then;
+    }
+
+    matcher_list_t *link = apr_palloc( pool, sizeof(matcher_list_t) );
+    link->matcher        = first->matcher;
+    link->next           = chain_matchers( pool, first->next, then );
+
+    return link;
+}
+
+// Compile a white list into a list of one matcher; NULL if it's empty
+const matcher_list_t *compile_matchers( apr_pool_t *pool,
+                                        const apr_array_header_t *prefixes,
+                                        const apr_array_header_t *names )
+{
+    matcher_t *m = compile_matcher( pool, prefixes, names );
+
+    if( !m ) {
+        return NULL;
+    }
+
+    matcher_list_t *list = apr_palloc( pool, sizeof(matcher_list_t) );
+    list->matcher        = m;
+    list->next           = NULL;
+
+    return list;
+}
+
+/* ********************************************
+
+    Scratch memory
+
+   ******************************************** */
+
+// Bytes still free in the arena, once aligned for the next allocation
+static APR_INLINE apr_size_t scratch_free(const scratch_t *sc)
+{
+    apr_size_t at = APR_ALIGN_DEFAULT( sc->used );
+
+    return at < sc->size ? sc->size - at : 0;
+}
+
+// size bytes from the arena, or from the request pool if they don't fit
+void *scratch_alloc(scratch_t *sc, apr_size_t size)
+{
+    apr_size_t at = APR_ALIGN_DEFAULT( sc->used );
+
+    if( at + size > sc->size || at + size < at ) {
+        _DEBUG && fprintf( stderr, "%" APR_SIZE_T_FMT " bytes don't fit in scratch;"
+                                   " using the request pool\n", size );
+
+        return apr_palloc( sc->fallback, size );
+    }
+
+    sc->used = at + size;
+    return sc->base + at;
+}
+
+/* ********************************************
+
+    Escaping & decoding
+
+   ******************************************** */
+
+// How many bytes does str (of len bytes) take up once escaped for use inside
+// a JSON string? For the common case of a clean string that's just len, found
+// with a single (vectorized) scan.
+apr_size_t json_escaped_len( const char *str, apr_size_t len )
+{
+    const char *end = str + len;
+    const char *p   = find_json_special( str, end );
+
+    while( p < end ) {
+        const unsigned char *c = (const unsigned char *)p;
+
+        switch( json_escape_table[*c] ) {
+            case 'u':   len += 5;   // \u00XX instead of 1 byte
+                        break;
+
+            case '?':   // U+2028 or U+2029 become \u2028 or \u2029
+                        if( end - p >= 3 && c[1] == 0x80 && (c[2] & 0xFE) == 0xA8 ) {
+                            len += 3;
+                            p   += 2;
+                        }
+                        break;
+
+            default:    len += 1;   // a backslash in front of it
+        }
+
+        p = find_json_special( p + 1, end );
+    }
+
+    return len;
+}
+
+// Write str (of len bytes) escaped for use inside a JSON string to out, which
+// must have room for json_escaped_len() bytes. Clean runs are copied in bulk.
+// Returns the position just past what was written.
+char *json_escape( char *out, const char *str, apr_size_t len )
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *end         = str + len;
+    const char *p           = str;
+
+    while( p < end ) {
+        const char *special     = find_json_special( p, end );
+        const unsigned char *c  = (const unsigned char *)special;
+
+        memcpy( out, p, special - p );
+        out += special - p;
+
+        if( special == end ) {
+            break;
+        }
+
+        switch( json_escape_table[*c] ) {
+            case 'u':   memcpy( out, "\\u00", 4 );
+                        out[4] = hex[ *c >> 4 ];
+                        out[5] = hex[ *c & 0xF ];
+                        out   += 6;
+                        p      = special + 1;
+                        break;
+
+            case '?':   if( end - special >= 3 && c[1] == 0x80 && (c[2] & 0xFE) == 0xA8 ) {
+                            memcpy( out, c[2] == 0xA8 ? "\\u2028" : "\\u2029", 6 );
+                            out += 6;
+                            p    = special + 3;
+                        } else {
+                            *out++ = *special;
+                            p      = special + 1;
+                        }
+                        break;
+
+            default:    *out++ = '\\';
+                        *out++ = json_escape_table[*c];
+                        p      = special + 1;
+        }
+    }
+
+    return out;
+}
+
+// the value of a single hex digit
+#define HEX_VALUE(c)    (apr_isdigit(c) ? (c) - '0' : apr_tolower(c) - 'a' + 10)
+
+// URL decode (%XX only) str, of len bytes. If there's nothing to decode, str
+// itself is returned; otherwise a decoded copy from the scratch arena. Malformed
+// escapes are left as they are. The decoded length is returned in *out_len.
+const char *url_decode( scratch_t *sc, const char *str, apr_size_t len,
+                        apr_size_t *out_len )
+{
+    const char *end = str + len;
+    const char *p   = memchr( str, '%', len );
+
+    *out_len = len;
+
+    if( !p ) {
+        return str;
+    }
+
+    char *decoded = scratch_alloc( sc, len );
+    char *out     = decoded + (p - str);
+
+    memcpy( decoded, str, p - str );
+
+    for( ; p < end; p++ ) {
+        if( *p == '%' && end - p >= 3 && apr_isxdigit(p[1]) && apr_isxdigit(p[2]) ) {
+            *out++ = (char)( (HEX_VALUE(p[1]) << 4) | HEX_VALUE(p[2]) );
+            p     += 2;
+        } else {
+            *out++ = *p;
+        }
+    }
+
+    *out_len = out - decoded;
+    return decoded;
+}
+
+/* ********************************************
+
+    Hashing
+
+   ******************************************** */
+
+// A fast, seeded 64 bit hash, for the response cache. Not cryptographic, but
+// with a random seed the values can't be predicted from outside the server.
+// Feed it a piece at a time: h = hash_bytes( h, ... ), starting from a seed.
+#define HASH_PRIME1     0x9E3779B185EBCA87ULL
+#define HASH_PRIME2     0xC2B2AE3D27D4EB4FULL
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+apr_uint64_t hash_bytes( apr_uint64_t h, const void *data, apr_size_t len )
+{
+    const char *p = (const char *)data;
+    apr_uint64_t k;
+
+    // the length goes in first, so ("ab", "c") and ("a", "bc") differ
+    h ^= (apr_uint64_t)len * HASH_PRIME2;
+
+    for( ; len >= 8; p += 8, len -= 8 ) {
+        memcpy( &k, p, 8 );
+        h ^= HASH_ROTL( k * HASH_PRIME2, 31 ) * HASH_PRIME1;
+        h  = HASH_ROTL( h, 27 ) * HASH_PRIME1 + HASH_PRIME2;
+    }
+
+    if( len ) {
+        k = 0;
+        memcpy( &k, p, len );
+        h ^= HASH_ROTL( k * HASH_PRIME2, 31 ) * HASH_PRIME1;
+        h  = HASH_ROTL( h, 27 ) * HASH_PRIME1 + HASH_PRIME2;
+    }
+
+    // final avalanche, so every input bit affects every output bit
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME1;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* ********************************************
+
+    Key sets
+
+   ******************************************** */
+
+// Fill the set from a comma separated list, like "a,b,c". Empty names are
+// skipped, and so is anything past the first KEYSET_MAX_KEYS names.
+void keyset_init(keyset_t *set, const char *list, apr_size_t len)
+{
+    const char *end = list + len;
+    int count = 0;
+
+    memset( set, 0, sizeof(*set) );
+
+    while( list < end && count < KEYSET_MAX_KEYS ) {
+        const char *comma = memchr( list, ',', end - list );
+        apr_size_t key_len = (comma ? comma : end) - list;
+
+        if( key_len ) {
+            keyset_entry_t *slot = keyset_slot( set, list, key_len );
+
+            if( !slot->key ) {
+                slot->key = list;
+                slot->len = key_len;
+                count++;
+            }
+        }
+
+        list += key_len + 1;
+    }
+}
+
+/* ********************************************
+
+    Response rendering
+
+   ******************************************** */
+
+// The fixed bits of the response. These are handed to the output filters as
+// immortal buckets, so they are never copied. The sizeof()s below include the
+// trailing NUL, hence all the - 1's.
+#define JSON_EMPTY          "{  }"
+#define JSON_OPEN           "{ \""
+#define JSON_KEY_CLOSE      "\": \""
+#define JSON_PAIR_SEP       "\", \""
+#define JSON_CLOSE          "\" }"
+#define JSONP_OPEN          "({\n  status: 200,\n  body: "
+#define JSONP_CLOSE         "\n});"
+
+// A key with more than one value (see C2JSONDuplicates) becomes an array:
+//   { "a": [ "1", "2" ], "b": "3" }
+// The separator or close after an array loses its leading quote.
+#define JSON_ARRAY_OPEN     "\": [ \""
+#define JSON_ARRAY_CLOSE    "\" ]"
+#define JSON_ARRAY_PAIR_SEP ", \""
+#define JSON_ARRAY_END      " }"
+
+// How many bytes of the body are down to a single pair, including the
+// separator that comes before or after it.
+static apr_size_t pair_bytes( const cookie_pair_t *pair )
+{
+    apr_size_t size = pair->key_out_len + pair->value_out_len
+                    + CONST_LEN(JSON_KEY_CLOSE) + CONST_LEN(JSON_PAIR_SEP);
+
+    if( pair->values > 1 ) {
+        const cookie_pair_t *more;
+
+        size += CONST_LEN(JSON_ARRAY_OPEN) - CONST_LEN(JSON_KEY_CLOSE)
+              + CONST_LEN(JSON_ARRAY_CLOSE) - 1;
+
+        for( more = pair->more; more; more = more->more ) {
+            size += CONST_LEN(JSON_PAIR_SEP) + more->value_out_len;
+        }
+    }
+
+    return size;
+}
+
+// Work out exactly how many bytes emit_body() will produce for these pairs, so
+// we can set the Content-Length up front without rendering anything.
+apr_size_t measure_body( const apr_array_header_t *pairs,
+                         apr_size_t callback_len )
+{
+    const cookie_pair_t *pair = (const cookie_pair_t *)pairs->elts;
+    apr_size_t size;
+    int i;
+
+    if( pairs->nelts ) {
+        // one separator fewer than there are pairs
+        size = CONST_LEN(JSON_OPEN) + CONST_LEN(JSON_CLOSE) - CONST_LEN(JSON_PAIR_SEP);
+
+        for( i = 0; i < pairs->nelts; i++ ) {
+            size += pair_bytes( &pair[i] );
+        }
+
+    } else {
+        size = CONST_LEN(JSON_EMPTY);
+    }
+
+    // you want it wrapped in a callback?
+    if( callback_len ) {
+        size += callback_len + CONST_LEN(JSONP_OPEN) + CONST_LEN(JSONP_CLOSE);
+    }
+
+    return size;
+}
+
+// Append a key or value to the brigade, escaped for JSON. Only strings that
+// actually need escaping are copied; clean ones go out as they are.
+static void emit_json_string( apr_bucket_brigade *bb, const char *str,
+                              apr_size_t len, apr_size_t json_len )
+{
+    if( json_len == len ) {
+        EMIT_SLICE( bb, str, len );
+        return;
+    }
+
+    char *escaped = apr_palloc( bb->p, json_len );
+    json_escape( escaped, str, len );
+
+    EMIT_SLICE( bb, escaped, json_len );
+}
+
+// Append the (JSONP) response for the given pairs to the brigade, without
+// building an intermediate string: the keys and values are referenced right
+// where they are in the Cookie header.
+void emit_body( apr_bucket_brigade *bb, const apr_array_header_t *pairs,
+                const char *callback, apr_size_t callback_len )
+{
+    const cookie_pair_t *pair = (const cookie_pair_t *)pairs->elts;
+    const cookie_pair_t *more;
+    int in_array = 0;
+    int i;
+
+    if( callback_len ) {
+        EMIT_SLICE( bb, callback, callback_len );
+        EMIT_CONST( bb, JSONP_OPEN );
+    }
+
+    if( pairs->nelts ) {
+        // Quote & escape the key/values - could contain anything
+        for( i = 0; i < pairs->nelts; i++ ) {
+            if( !i ) {
+                EMIT_CONST( bb, JSON_OPEN );
+            } else if( in_array ) {
+                EMIT_CONST( bb, JSON_ARRAY_PAIR_SEP );
+            } else {
+                EMIT_CONST( bb, JSON_PAIR_SEP );
+            }
+
+            emit_json_string( bb, pair[i].key,   pair[i].key_len,
+                                  pair[i].key_out_len );
+
+            in_array = pair[i].values > 1;
+
+            if( in_array ) {
+                EMIT_CONST( bb, JSON_ARRAY_OPEN );
+            } else {
+                EMIT_CONST( bb, JSON_KEY_CLOSE );
+            }
+
+            emit_json_string( bb, pair[i].value, pair[i].value_len,
+                                  pair[i].value_out_len );
+
+            if( in_array ) {
+                for( more = pair[i].more; more; more = more->more ) {
+                    EMIT_CONST( bb, JSON_PAIR_SEP );
+                    emit_json_string( bb, more->value, more->value_len,
+                                          more->value_out_len );
+                }
+
+                EMIT_CONST( bb, JSON_ARRAY_CLOSE );
+            }
+        }
+
+        if( in_array ) {
+            EMIT_CONST( bb, JSON_ARRAY_END );
+        } else {
+            EMIT_CONST( bb, JSON_CLOSE );
+        }
+
+    } else {
+        EMIT_CONST( bb, JSON_EMPTY );
+    }
+
+    if( callback_len ) {
+        EMIT_CONST( bb, JSONP_CLOSE );
+    }
+}
+
+/* ********************************************
+
+    Binary formats
+
+   ******************************************** */
+
+// Indexed by FORMAT_JSON etc; see format_info_t
+const format_info_t formats[] = {
+    { "json",       "text/javascript",      JSON_EMPTY, CONST_LEN(JSON_EMPTY) },
+    { "msgpack",    "application/msgpack",  "\x80",     1 },   // fixmap, 0 pairs
+    { "cbor",       "application/cbor",     "\xA0",     1 },   // map, 0 pairs
+};
+
+// MessagePack and CBOR describe the same things the same way: a type byte,
+// followed by a length of 0, 1, 2 or 4 bytes (big endian), and then the
+// contents, if any. Our responses only use 4 kinds of things.
+enum { PACK_MAP, PACK_ARRAY, PACK_TEXT, PACK_BYTES, PACK_KINDS };
+
+#define PACK_HEADER_MAX     5   // type byte + 32 bit length; cookies are never 4GB
+
+typedef struct {
+    unsigned char fix;          // the type byte, with the length added to it...
+    unsigned char fix_limit;    // ... if the length is below this
+    unsigned char len8;         // the type byte for a 1 byte length; 0 for none
+    unsigned char len16;        // and for 2 and 4 byte lengths
+    unsigned char len32;
+} pack_type_t;
+
+// Indexed by format - FORMAT_MSGPACK, and the kind
+static const pack_type_t pack_types[][PACK_KINDS] = {
+    // MessagePack: fixmap/map16/map32, fixarray/..., fixstr/str8/..., bin8/...
+    {   { 0x80, 16, 0x00, 0xDE, 0xDF },
+        { 0x90, 16, 0x00, 0xDC, 0xDD },
+        { 0xA0, 32, 0xD9, 0xDA, 0xDB },
+        { 0x00,  0, 0xC4, 0xC5, 0xC6 }  },
+
+    // CBOR: the major type in the top 3 bits; 5 = map, 4 = array, 3 = text
+    // string, 2 = byte string. Lengths of 24 and up follow the type byte.
+    {   { 0xA0, 24, 0xB8, 0xB9, 0xBA },
+        { 0x80, 24, 0x98, 0x99, 0x9A },
+        { 0x60, 24, 0x78, 0x79, 0x7A },
+        { 0x40, 24, 0x58, 0x59, 0x5A }  },
+};
+
+// Write the header for a map, array or string of n entries or bytes to out,
+// which has room for PACK_HEADER_MAX bytes, and return its length.
+static apr_size_t pack_header( unsigned char *out, int format, int kind, apr_size_t n )
+{
+    const pack_type_t *type = &pack_types[format - FORMAT_MSGPACK][kind];
+
+    if( n < type->fix_limit ) {
+        out[0] = type->fix | (unsigned char)n;
+        return 1;
+    }
+
+    if( n <= 0xFF && type->len8 ) {
+        out[0] = type->len8;
+        out[1] = (unsigned char)n;
+        return 2;
+    }
+
+    if( n <= 0xFFFF ) {
+        out[0] = type->len16;
+        out[1] = (unsigned char)(n >> 8);
+        out[2] = (unsigned char)n;
+        return 3;
+    }
+
+    out[0] = type->len32;
+    out[1] = (unsigned char)(n >> 24);
+    out[2] = (unsigned char)(n >> 16);
+    out[3] = (unsigned char)(n >> 8);
+    out[4] = (unsigned char)n;
+    return 5;
+}
+
+// Just the length of the above
+static APR_INLINE apr_size_t packed_header_len( int format, int kind, apr_size_t n )
+{
+    unsigned char header[PACK_HEADER_MAX];
+
+    return pack_header( header, format, kind, n );
+}
+
+// Is [p, end) valid UTF-8? Overlong forms, surrogates and anything past
+// U+10FFFF are not. Cookies are nearly always ASCII, which is skipped quickly.
+static int utf8_valid( const char *p, const char *end )
+{
+    while( (p = find_non_ascii( p, end )) < end ) {
+        const unsigned char c = (unsigned char)*p;
+        unsigned char lo      = 0x80;   // the range of the byte after c
+        unsigned char hi      = 0xBF;
+        int follow;
+
+        if( c >= 0xC2 && c <= 0xDF ) {
+            follow = 1;
+        } else if( c >= 0xE0 && c <= 0xEF ) {
+            follow = 2;
+            lo     = c == 0xE0 ? 0xA0 : 0x80;
+            hi     = c == 0xED ? 0x9F : 0xBF;
+        } else if( c >= 0xF0 && c <= 0xF4 ) {
+            follow = 3;
+            lo     = c == 0xF0 ? 0x90 : 0x80;
+            hi     = c == 0xF4 ? 0x8F : 0xBF;
+        } else {
+            return 0;
+        }
+
+        if( end - p <= follow ) {
+            return 0;
+        }
+
+        if( (unsigned char)p[1] < lo || (unsigned char)p[1] > hi ) {
+            return 0;
+        }
+
+        for( p += 2; --follow > 0; p++ ) {
+            if( ((unsigned char)*p & 0xC0) != 0x80 ) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// How many bytes a key or value takes up in the body, header included. Text
+// has to be valid UTF-8; anything else is sent as bytes, and *binary is set.
+apr_size_t packed_string_len( int format, const char *str, apr_size_t len,
+                              char *binary )
+{
+    *binary = !utf8_valid( str, str + len );
+
+    return packed_header_len( format, *binary ? PACK_BYTES : PACK_TEXT, len ) + len;
+}
+
+// How many bytes of the body are down to a single pair
+static apr_size_t packed_pair_bytes( int format, const cookie_pair_t *pair )
+{
+    apr_size_t size = pair->key_out_len + pair->value_out_len;
+
+    if( pair->values > 1 ) {
+        const cookie_pair_t *more;
+
+        size += packed_header_len( format, PACK_ARRAY, pair->values );
+
+        for( more = pair->more; more; more = more->more ) {
+            size += more->value_out_len;
+        }
+    }
+
+    return size;
+}
+
+// Work out exactly how many bytes emit_packed() will produce for these pairs
+static apr_size_t measure_packed( const apr_array_header_t *pairs, int format )
+{
+    const cookie_pair_t *pair = (const cookie_pair_t *)pairs->elts;
+    apr_size_t size           = packed_header_len( format, PACK_MAP, pairs->nelts );
+    int i;
+
+    for( i = 0; i < pairs->nelts; i++ ) {
+        size += packed_pair_bytes( format, &pair[i] );
+    }
+
+    return size;
+}
+
+// Append a header to the brigade. It's written at *at, which is moved past it.
+static APR_INLINE void emit_packed_header( apr_bucket_brigade *bb, unsigned char **at,
+                                           int format, int kind, apr_size_t n )
+{
+    apr_size_t len = pack_header( *at, format, kind, n );
+
+    EMIT_SLICE( bb, (const char *)*at, len );
+    *at += len;
+}
+
+// Append a key or value to the brigade: its header, and then the string as is
+static APR_INLINE void emit_packed_string( apr_bucket_brigade *bb, unsigned char **at,
+                                           int format, const char *str,
+                                           apr_size_t len, char binary )
+{
+    emit_packed_header( bb, at, format, binary ? PACK_BYTES : PACK_TEXT, len );
+
+    if( len ) {
+        EMIT_SLICE( bb, str, len );
+    }
+}
+
+// Append the MessagePack or CBOR response for the given pairs to the brigade:
+// a map of keys to values, or to arrays of values. Like emit_body(), the keys
+// and values are referenced where they are; only the headers are written out,
+// all of them into a single buffer.
+static void emit_packed( apr_bucket_brigade *bb, const apr_array_header_t *pairs,
+                         int format )
+{
+    const cookie_pair_t *pair = (const cookie_pair_t *)pairs->elts;
+    const cookie_pair_t *more;
+    apr_size_t headers        = 1;
+    int i;
+
+    // the map, and per pair the key and the value, or an array and its values
+    for( i = 0; i < pairs->nelts; i++ ) {
+        headers += pair[i].values > 1 ? pair[i].values + 2 : 2;
+    }
+
+    unsigned char *at = apr_palloc( bb->p, headers * PACK_HEADER_MAX );
+
+    emit_packed_header( bb, &at, format, PACK_MAP, pairs->nelts );
+
+    for( i = 0; i < pairs->nelts; i++ ) {
+        emit_packed_string( bb, &at, format, pair[i].key, pair[i].key_len,
+                            pair[i].key_binary );
+
+        if( pair[i].values > 1 ) {
+            emit_packed_header( bb, &at, format, PACK_ARRAY, pair[i].values );
+        }
+
+        emit_packed_string( bb, &at, format, pair[i].value, pair[i].value_len,
+                            pair[i].value_binary );
+
+        for( more = pair[i].more; more; more = more->more ) {
+            emit_packed_string( bb, &at, format, more->value, more->value_len,
+                                more->value_binary );
+        }
+    }
+}
+
+// The size of the body in the given format; the callback only applies to JSON
+apr_size_t measure_response( const apr_array_header_t *pairs, int format,
+                             apr_size_t callback_len )
+{
+    return format == FORMAT_JSON ? measure_body( pairs, callback_len )
+                                 : measure_packed( pairs, format );
+}
+
+// Fill the brigade with the body in the given format
+void emit_response( apr_bucket_brigade *bb, const apr_array_header_t *pairs,
+                    int format, const char *callback, apr_size_t callback_len )
+{
+    if( format == FORMAT_JSON ) {
+        emit_body( bb, pairs, callback, callback_len );
+    } else {
+        emit_packed( bb, pairs, format );
+    }
+}
+
+// Leave the last pair out of the response, and return how many bytes smaller
+// that makes the body. There has to be more than one pair.
+apr_size_t drop_last_pair( apr_array_header_t *pairs, int format )
+{
+    const cookie_pair_t *last = &((cookie_pair_t *)pairs->elts)[--pairs->nelts];
+
+    if( format == FORMAT_JSON ) {
+        return pair_bytes( last );
+    }
+
+    // the map header can get shorter too
+    return packed_pair_bytes( format, last )
+         + packed_header_len( format, PACK_MAP, pairs->nelts + 1 )
+         - packed_header_len( format, PACK_MAP, pairs->nelts );
+}
+
+/* ********************************************
+
+    Cookie pairs
+
+   ******************************************** */
+
+// Split the first header_len bytes of the Cookie header into pairs, in the
+// order they were sent, and add them to 'pairs'. Every pair points straight
+// into cookie_header, so nothing is copied until we write the body. Stops
+// after max_cookies pairs (unless that's 0), and returns 1 if there were more.
+int parse_pairs(const char *cookie_header, apr_size_t header_len,
+                apr_array_header_t *pairs, apr_size_t max_cookies)
+{
+    _DEBUG && fprintf( stderr, "Cookie header: %s\n", cookie_header );
+
+    // Walk the header exactly once.
+    const char *cursor = cookie_header;
+    const char *end    = cookie_header + header_len;
+    cookie_pair_t pair;
+
+    while( next_cookie_pair( &cursor, end, &pair ) ) {
+
+        if( max_cookies && (apr_size_t)pairs->nelts == max_cookies ) {
+            _DEBUG && fprintf( stderr, "More than %" APR_SIZE_T_FMT " cookies\n", max_cookies );
+            return 1;
+        }
+
+        _DEBUG && fprintf( stderr, "Individual pair: %.*s=%.*s\n",
+                            (int)pair.key_len, pair.key,
+                            (int)pair.value_len, pair.value );
+
+        pair.values = 1;
+        pair.more   = NULL;
+
+        *(cookie_pair_t *)apr_array_push( pairs ) = pair;
+    }
+
+    return 0;
+}
+
+// The length of the Cookie header, cut back to at most max bytes. Cookies
+// that straddle the limit are left out entirely, rather than cut in half.
+apr_size_t cut_header(const char *cookie_header, apr_size_t max)
+{
+    apr_size_t len = max;
+
+    // If the limit falls right on a separator, the cookie before it is whole
+    while( len > 0 && cookie_header[len] != ';' && cookie_header[len] != ',' ) {
+        len--;
+    }
+
+    return len;
+}
+
+// An empty array for the pairs in a Cookie header of header_len bytes, with
+// its elements in the scratch arena. Every cookie takes at least 2 bytes of
+// the header, so that's as many as there can be, and if they don't all fit
+// the array grows into the request pool, as usual. 'arr' is the header to
+// use, which only needs to live as long as the request is being handled.
+apr_array_header_t *scratch_pairs(scratch_t *sc, apr_array_header_t *arr,
+                                  apr_size_t header_len, apr_size_t max_cookies)
+{
+    apr_size_t want = header_len / 2 + 1;
+    apr_size_t fits = scratch_free( sc ) / sizeof(cookie_pair_t);
+
+    // parse_pairs() never goes past the limit
+    if( max_cookies && want > max_cookies ) {
+        want = max_cookies;
+    }
+
+    if( fits > want ) {
+        fits = want;
+    }
+
+    if( !fits ) {
+        return apr_array_make( sc->fallback, 16, sizeof(cookie_pair_t) );
+    }
+
+    arr->pool       = sc->fallback;
+    arr->elt_size   = sizeof(cookie_pair_t);
+    arr->nelts      = 0;
+    arr->nalloc     = (int)fits;
+    arr->elts       = scratch_alloc( sc, fits * sizeof(cookie_pair_t) );
+
+    return arr;
+}
+
+// Deal with cookies that were sent more than once (browsers do that for the
+// same name set on different paths or domains), as set by C2JSONDuplicates:
+// keep the first or last value, or all of them as an array, in the position
+// the key was first seen. Pairs are matched on their key with an open
+// addressing hash table that lives on the stack, unless there are a lot of
+// pairs and it goes in the scratch arena; in the usual case of no duplicates,
+// nothing else happens.
+#define DEDUPE_STACK_PAIRS  64      // pairs we can handle on the stack
+#define DEDUPE_SEED         0x6475706C69636174ULL
+
+void dedupe_pairs(scratch_t *sc, int duplicates, apr_array_header_t *pairs)
+{
+    cookie_pair_t *pair  = (cookie_pair_t *)pairs->elts;
+    cookie_pair_t *extra = NULL;    // copies of the extra values, for arrays
+    int stack_slots[DEDUPE_STACK_PAIRS * 2];
+    int *slots           = stack_slots;
+    apr_size_t size      = DEDUPE_STACK_PAIRS * 2;
+    int n                = pairs->nelts;
+    int dups             = 0;
+    int i;
+
+    if( n < 2 ) {
+        return;
+    }
+
+    // keep the table at most half full
+    if( n > DEDUPE_STACK_PAIRS ) {
+        while( size < (apr_size_t)n * 2 ) {
+            size <<= 1;
+        }
+
+        slots = scratch_alloc( sc, size * sizeof(int) );
+    }
+
+    // slots hold the index of the first pair with a key, plus 1; 0 is empty
+    memset( slots, 0, size * sizeof(int) );
+
+    for( i = 0; i < n; i++ ) {
+        apr_size_t at = (apr_size_t) hash_bytes( DEDUPE_SEED, pair[i].key, pair[i].key_len )
+                      & (size - 1);
+        cookie_pair_t *first = NULL;
+
+        while( slots[at] ) {
+            cookie_pair_t *seen = &pair[ slots[at] - 1 ];
+
+            if( seen->key_len == pair[i].key_len &&
+                memcmp( seen->key, pair[i].key, pair[i].key_len ) == 0
+            ) {
+                first = seen;
+                break;
+            }
+
+            at = (at + 1) & (size - 1);
+        }
+
+        if( !first ) {
+            slots[at] = i + 1;
+            continue;
+        }
+
+        _DEBUG && fprintf( stderr, "Cookie %.*s was sent more than once\n",
+                            (int)pair[i].key_len, pair[i].key );
+
+        // this one goes, one way or another
+        pair[i].values = 0;
+        dups++;
+
+        if( duplicates == DUPLICATES_LAST ) {
+            first->value            = pair[i].value;
+            first->value_len        = pair[i].value_len;
+            first->value_out_len    = pair[i].value_out_len;
+            first->value_binary     = pair[i].value_binary;
+
+        } else if( duplicates == DUPLICATES_ARRAY ) {
+            // The pairs array gets compacted below, so the extra values are
+            // copied out; room for all the ones that are left, in one go.
+            if( !extra ) {
+                extra = scratch_alloc( sc, (n - i) * sizeof(cookie_pair_t) );
+            }
+
+            // chained in reverse for now; put right below
+            *extra          = pair[i];
+            extra->more     = first->more;
+            first->more     = extra++;
+            first->values++;
+        }
+    }
+
+    if( !dups ) {
+        return;
+    }
+
+    // Drop the duplicates, and put the values of the arrays in order
+    cookie_pair_t *keep = pair;
+
+    for( i = 0; i < n; i++ ) {
+        if( !pair[i].values ) {
+            continue;
+        }
+
+        cookie_pair_t *more = pair[i].more;
+        cookie_pair_t *prev = NULL;
+
+        while( more ) {
+            cookie_pair_t *next = more->more;
+            more->more          = prev;
+            prev                = more;
+            more                = next;
+        }
+
+        pair[i].more = prev;
+        *keep++      = pair[i];
+    }
+
+    pairs->nelts = keep - pair;
+
+    _DEBUG && fprintf( stderr, "%d duplicate cookies\n", dups );
+}
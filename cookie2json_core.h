@@ -0,0 +1,378 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The request independent core of mod_cookie2json: tokenizing the Cookie
+ * header, white lists, escaping and decoding, and rendering the pairs as
+ * JSON(P), MessagePack or CBOR. This uses APR and APR-util only, no httpd,
+ * so it can be benchmarked on its own; see bench/bench.c. Nothing in here is
+ * meant for other modules; see mod_cookie2json.h for that.
+ */
+
+#ifndef COOKIE2JSON_CORE_H
+#define COOKIE2JSON_CORE_H
+
+#include <stdio.h>
+
+#include "apr.h"
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+#include "apr_buckets.h"
+
+#define APR_WANT_STRFUNC
+#include "apr_want.h"
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+// Force the compiler to inline a function, so it can be specialized for the
+// (constant) arguments at every call site
+#if defined(__GNUC__)
+#define ALWAYS_INLINE   APR_INLINE __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE   APR_INLINE
+#endif
+
+#ifdef DEBUG                    // To print diagnostics to the error log
+#define _DEBUG 1                // enable through gcc -DDEBUG
+#else
+#define _DEBUG 0
+#endif
+
+// Everything cookie2json_core.c shares with the module. It's all linked into
+// mod_cookie2json.so, and none of it should be visible to the rest of httpd.
+#if defined(__GNUC__)
+#define C2JSON_CORE     __attribute__((visibility("hidden")))
+#else
+#define C2JSON_CORE
+#endif
+
+#define CONST_LEN(str)      (sizeof(str) - 1)
+
+// A list of prefixes and/or exact names, compiled into a case insensitive DFA.
+// Every byte of the input costs one table lookup, no matter how many entries
+// are in the list. See compile_matcher() & matcher_match()
+typedef struct {
+    unsigned char byte_class[256];  // input byte -> column in 'next'; 0 means
+                                    // the byte doesn't occur in any entry
+    int nclasses;                   // columns per state in 'next'
+    int nstates;                    // state 0 is 'no match', 1 is the start
+    apr_uint16_t *next;             // nstates * nclasses transitions
+    unsigned char *accept;          // per state; MATCH_PREFIX and/or MATCH_EXACT
+} matcher_t;
+
+#define MATCH_PREFIX    0x1         // anything starting with this state matches
+#define MATCH_EXACT     0x2         // input ending in this state matches
+
+#define MATCHER_MAX_BYTES   65000   // total bytes per list; keeps states < 2^16
+
+// Nested sections inherit the white lists of their parents. Merging happens
+// per request, so rather than compiling a new DFA for the combined list, a
+// merged config keeps a chain of the compiled ones; a match in any will do.
+typedef struct matcher_list_t {
+    const matcher_t *matcher;
+    const struct matcher_list_t *next;
+} matcher_list_t;
+
+// A single key/value pair out of the Cookie header. Both halves point straight
+// into the original header string and are NOT NUL terminated; use the lengths.
+typedef struct cookie_pair_t cookie_pair_t;
+
+struct cookie_pair_t {
+    const char *key;
+    apr_size_t key_len;
+    const char *value;
+    apr_size_t value_len;
+    apr_size_t key_out_len;     // the lengths of the key and value in the body:
+    apr_size_t value_out_len;   // escaped for JSON (see json_escaped_len()), or
+                                // with their header for MessagePack & CBOR
+    char key_binary;            // not valid UTF-8, so sent as bytes rather than
+    char value_binary;          // text by MessagePack & CBOR
+    int values;                 // 1, or more with C2JSONDuplicates array
+    cookie_pair_t *more;        // the other values for this key, in order
+};
+
+#define DUPLICATES_ALL      0   // C2JSONDuplicates; the default
+#define DUPLICATES_FIRST    1
+#define DUPLICATES_LAST     2
+#define DUPLICATES_ARRAY    3
+
+#define FORMAT_JSON         0   // C2JSONFormat; the default. Or JSONP
+#define FORMAT_MSGPACK      1
+#define FORMAT_CBOR         2
+#define FORMAT_AUTO         3   // one of the above, as the Accept header says
+
+// Everything that differs between the response formats, other than the body
+// itself. See C2JSONFormat; FORMAT_AUTO isn't in here, as it always turns
+// into one of these before a response is made.
+typedef struct {
+    const char *name;           // as used with C2JSONFormat
+    const char *content_type;
+    const char *empty;          // the body when there are no cookies to send
+    apr_size_t empty_len;
+} format_info_t;
+
+C2JSON_CORE extern const format_info_t formats[FORMAT_AUTO];
+
+// Working memory for a single request; see scratch_alloc(), and scratch_for()
+// in mod_cookie2json.c
+typedef struct {
+    char *base;
+    apr_size_t size;
+    apr_size_t used;
+    apr_pool_t *fallback;       // the request pool, for whatever doesn't fit
+} scratch_t;
+
+/* ********************************************
+
+    Byte scanning
+
+   ******************************************** */
+
+// Find the first occurrence of any of (up to) three bytes, or of a byte of a
+// given kind, in [p, end). They return end if there is none.
+typedef const char *(*find_any_fn)( const char *p, const char *end,
+                                    char a, char b, char c );
+
+typedef const char *(*find_byte_fn)( const char *p, const char *end );
+
+// The best implementations for this CPU, once select_scanners() has run
+C2JSON_CORE extern find_any_fn  find_any;
+C2JSON_CORE extern find_byte_fn find_invalid_callback_char;    // not [.0-9A-Z_a-z]
+C2JSON_CORE extern find_byte_fn find_json_special;             // needs escaping in JSON
+C2JSON_CORE extern find_byte_fn find_non_ascii;
+
+C2JSON_CORE void select_scanners( void );
+
+/* ********************************************
+
+    Prefix & name matching
+
+   ******************************************** */
+
+// Compile a white list into a list of one matcher; NULL if it's empty
+C2JSON_CORE const matcher_list_t *compile_matchers( apr_pool_t *pool,
+                                                    const apr_array_header_t *prefixes,
+                                                    const apr_array_header_t *names );
+
+// Chain the matchers in 'first' and 'then' together; either can be NULL
+C2JSON_CORE const matcher_list_t *chain_matchers( apr_pool_t *pool,
+                                                  const matcher_list_t *first,
+                                                  const matcher_list_t *then );
+
+// Does str (of len bytes) match any of the matchers in the list?
+C2JSON_CORE int matchers_match( const matcher_list_t *list, const char *str,
+                                apr_size_t len );
+
+/* ********************************************
+
+    Scratch memory, escaping, decoding & hashing
+
+   ******************************************** */
+
+// size bytes from the arena, or from sc->fallback if they don't fit
+C2JSON_CORE void *scratch_alloc( scratch_t *sc, apr_size_t size );
+
+// The length of str once escaped for use inside a JSON string, and the
+// escaping itself; out must have room for json_escaped_len() bytes
+C2JSON_CORE apr_size_t json_escaped_len( const char *str, apr_size_t len );
+C2JSON_CORE char *json_escape( char *out, const char *str, apr_size_t len );
+
+// URL decode (%XX only) str; str itself if there's nothing to decode
+C2JSON_CORE const char *url_decode( scratch_t *sc, const char *str, apr_size_t len,
+                                    apr_size_t *out_len );
+
+// A fast, seeded 64 bit hash: h = hash_bytes( h, ... ), starting from a seed
+C2JSON_CORE apr_uint64_t hash_bytes( apr_uint64_t h, const void *data, apr_size_t len );
+
+/* ********************************************
+
+    Key sets
+
+   ******************************************** */
+
+// The set of cookie names asked for with C2JSONKeysFrom, as a small open
+// addressing hash table that lives on the stack for the length of a request.
+// The entries point into the query string; nothing is copied. Names are
+// compared exactly, as cookie names are case sensitive.
+#define KEYSET_SLOTS    64                  // a power of 2
+#define KEYSET_MAX_KEYS (KEYSET_SLOTS / 2)  // keep it at most half full
+#define KEYSET_SEED     0x6B65797365747321ULL
+
+typedef struct {
+    const char *key;            // NULL for an empty slot
+    apr_size_t len;
+} keyset_entry_t;
+
+typedef struct {
+    keyset_entry_t slots[KEYSET_SLOTS];
+} keyset_t;
+
+// Find the slot for a name: either the one it's in, or the empty one where
+// it should go.
+static ALWAYS_INLINE keyset_entry_t *keyset_slot(keyset_t *set, const char *key,
+                                                 apr_size_t len)
+{
+    apr_size_t i = (apr_size_t) hash_bytes( KEYSET_SEED, key, len ) & (KEYSET_SLOTS - 1);
+
+    while( set->slots[i].key &&
+           !(set->slots[i].len == len && memcmp( set->slots[i].key, key, len ) == 0)
+    ) {
+        i = (i + 1) & (KEYSET_SLOTS - 1);
+    }
+
+    return &set->slots[i];
+}
+
+// Is this name in the set?
+static ALWAYS_INLINE int keyset_has(keyset_t *set, const char *key, apr_size_t len)
+{
+    return keyset_slot( set, key, len )->key != NULL;
+}
+
+// Fill the set from a comma separated list, like "a,b,c"
+C2JSON_CORE void keyset_init( keyset_t *set, const char *list, apr_size_t len );
+
+/* ********************************************
+
+    Response rendering
+
+   ******************************************** */
+
+// Append a constant fragment of the response to the brigade
+#define EMIT_CONST(bb, str) \
+    APR_BRIGADE_INSERT_TAIL( (bb), apr_bucket_immortal_create( \
+                                    (str), CONST_LEN(str), (bb)->bucket_alloc ) )
+
+// Append a slice of the request (a key, value or callback) to the brigade.
+// These point into memory owned by the request, so they are transient: any
+// filter that needs to hold on to them past this call will copy them.
+#define EMIT_SLICE(bb, str, len) \
+    APR_BRIGADE_INSERT_TAIL( (bb), apr_bucket_transient_create( \
+                                    (str), (len), (bb)->bucket_alloc ) )
+
+// The size of a JSON(P) body, and the body itself
+C2JSON_CORE apr_size_t measure_body( const apr_array_header_t *pairs,
+                                     apr_size_t callback_len );
+C2JSON_CORE void emit_body( apr_bucket_brigade *bb, const apr_array_header_t *pairs,
+                            const char *callback, apr_size_t callback_len );
+
+// How many bytes a key or value takes up in a MessagePack or CBOR body; sets
+// *binary if it has to be sent as bytes rather than text
+C2JSON_CORE apr_size_t packed_string_len( int format, const char *str, apr_size_t len,
+                                          char *binary );
+
+// The size of the body in any format, and the body itself; the callback only
+// applies to JSON
+C2JSON_CORE apr_size_t measure_response( const apr_array_header_t *pairs, int format,
+                                         apr_size_t callback_len );
+C2JSON_CORE void emit_response( apr_bucket_brigade *bb, const apr_array_header_t *pairs,
+                                int format, const char *callback, apr_size_t callback_len );
+
+// Leave the last pair out, and return how many bytes smaller that makes the body
+C2JSON_CORE apr_size_t drop_last_pair( apr_array_header_t *pairs, int format );
+
+/* ********************************************
+
+    Cookie pairs
+
+   ******************************************** */
+
+// Split the first header_len bytes of the Cookie header into pairs; returns 1
+// if there were more than max_cookies (unless that's 0)
+C2JSON_CORE int parse_pairs( const char *cookie_header, apr_size_t header_len,
+                             apr_array_header_t *pairs, apr_size_t max_cookies );
+
+// The length of the Cookie header, cut back to at most max bytes, on a separator
+C2JSON_CORE apr_size_t cut_header( const char *cookie_header, apr_size_t max );
+
+// An empty array for the pairs in a Cookie header, with its elements in the
+// scratch arena, using 'arr' for the array header
+C2JSON_CORE apr_array_header_t *scratch_pairs( scratch_t *sc, apr_array_header_t *arr,
+                                               apr_size_t header_len, apr_size_t max_cookies );
+
+// Deal with cookies that were sent more than once; see DUPLICATES_ALL
+C2JSON_CORE void dedupe_pairs( scratch_t *sc, int duplicates, apr_array_header_t *pairs );
+
+// Keep only the pairs that are on the white list (and in 'keys', unless that's
+// NULL), in place and in order, and get them ready to be rendered: decoded if
+// needed, and measured for the given format. They still point into the Cookie
+// header, unless they had to be decoded. 'whitelist' says whether to check
+// the pairs against 'matchers'; it's a constant in every caller, so this gets
+// specialized for it; see RESPONDER() in mod_cookie2json.c. That's also why
+// this is in here, rather than in cookie2json_core.c.
+static ALWAYS_INLINE void filter_pairs(scratch_t *sc, const matcher_list_t *matchers,
+                                       int decode_values, apr_array_header_t *pairs,
+                                       keyset_t *keys, int format, const int whitelist)
+{
+    cookie_pair_t *pair = (cookie_pair_t *)pairs->elts;
+    cookie_pair_t *keep = pair;
+    cookie_pair_t *end  = pair + pairs->nelts;
+
+    for( ; pair < end; pair++ ) {
+
+        // Are you whitelisting based on prefixes or names? If so, let's
+        // make sure this key is ok. If there was a white list but we don't
+        // find a match for this key, we have to skip it
+        if( whitelist &&
+            !matchers_match( matchers, pair->key, pair->key_len )
+        ) {
+            _DEBUG && fprintf( stderr,
+                "Cookie %.*s is not on the whitelist - skipping\n",
+                (int)pair->key_len, pair->key );
+
+            continue;
+        }
+
+        // And if specific cookies were asked for, is this one of them?
+        if( keys && !keyset_has( keys, pair->key, pair->key_len ) ) {
+            _DEBUG && fprintf( stderr,
+                "Cookie %.*s was not asked for - skipping\n",
+                (int)pair->key_len, pair->key );
+
+            continue;
+        }
+
+        *keep = *pair;
+
+        // Return the value as it was set, rather than as it was sent?
+        if( decode_values ) {
+            keep->value = url_decode( sc, keep->value, keep->value_len,
+                                      &keep->value_len );
+        }
+
+        if( format == FORMAT_JSON ) {
+            keep->key_out_len   = json_escaped_len( keep->key,   keep->key_len );
+            keep->value_out_len = json_escaped_len( keep->value, keep->value_len );
+        } else {
+            keep->key_out_len   = packed_string_len( format, keep->key, keep->key_len,
+                                                     &keep->key_binary );
+            keep->value_out_len = packed_string_len( format, keep->value, keep->value_len,
+                                                     &keep->value_binary );
+        }
+
+        keep++;
+    }
+
+    pairs->nelts = keep - (cookie_pair_t *)pairs->elts;
+
+    _DEBUG && fprintf( stderr, "body will contain %d pairs\n", pairs->nelts );
+}
+
+#endif /* COOKIE2JSON_CORE_H */
@@ -33,410 +33,2101 @@
 #include "util_script.h"
 #include "http_connection.h"
 
+#include "apr_shm.h"
+#include "apr_atomic.h"
+#include "apr_general.h"
+#include "apr_hash.h"
+#include "apr_optional.h"
 
+#include "mod_cookie2json.h"
+#include "cookie2json_core.h"
+
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+typedef struct plan_t plan_t;
+
+// Builds and sends the response; there's one for each combination of
+// features a location can use. See select_responder()
+typedef int (*respond_fn)(request_rec *r, const plan_t *plan);
+
+// The compiled, read only form of a settings_rec: everything the request
+// handling needs, with defaults filled in and all the work that can be done
+// up front done. Built once per section in post_config(), or when configs are
+// merged. It's never modified afterwards, so threads can share it freely.
+struct plan_t {
+    int enabled;                // module enabled?
+    int decode_values;          // URL decode the cookie values before returning them
+    int early;                  // answer from the quick handler?
+    int jsonp;                  // is there a callback param to look for?
+    int etag;                   // send an ETag, and honour If-None-Match?
+    int vary_cookie;            // send Vary: Cookie?
+    int timings;                // time the phases of every request?
+    int server_timing;          // and send the timings in a Server-Timing header?
+    int duplicates;             // what to do with cookies sent more than once
+    int format;                 // FORMAT_JSON etc, or FORMAT_AUTO to negotiate
+    int set_env;                // put the cookies in r->subprocess_env?
+    const char *callback_name;  // use this query string keys value as the callback
+    apr_size_t callback_name_len;
+    const char *keys_name;      // only return the cookies listed in this query
+    apr_size_t keys_name_len;   // string parameter; "" if there isn't one
+    const char *header_name;    // add the cookies to other responses in this
+                                // header; NULL if not
+    const char *placeholder;    // and/or in place of this in HTML pages; "" if not
+    apr_size_t placeholder_len;
+    const matcher_list_t *cookie_matchers;
+                                // the white list of cookies; NULL if there is none
+    const matcher_list_t *callback_matchers;
+                                // the callback prefixes; NULL if there are none
+    respond_fn respond;         // the responder for this combination of settings
+    apr_interval_time_t cache_ttl;
+                                // keep responses in the cache this long; 0 = don't
+    const char *cache_control;  // the Cache-Control header to send; NULL if none
+    apr_size_t max_cookies;     // the limits on the work per request; 0 = none
+    apr_size_t max_header_bytes;
+    apr_size_t max_response_bytes;
+    int limit_action;           // LIMIT_TRUNCATE, or the status to return
+    int stats_slot;             // where to count requests; see stats_for()
+    apr_uint64_t fingerprint;   // a hash of all of the above; plans that would
+                                // produce different responses have different ones
+};
+
+static respond_fn select_responder(const plan_t *plan);
+
+#define UNSET   -1              // for settings that weren't configured in a section
+
+#define LIMIT_TRUNCATE  0       // C2JSONLimitAction truncate; the default
+
+// module configuration - this is basically a global struct
+typedef struct {
+    int enabled;                // module enabled?
+    int decode_values;          // URL decode the cookie values before returning them
+    int early;                  // answer from the quick handler?
+    char *callback_name_from;   // use this query string keys value as the callback
+    char *keys_from;            // only return the cookies listed in this parameter
+    char *header_name;          // add the cookies to other responses in this header
+    char *placeholder;          // or in place of this string in HTML responses
+    apr_array_header_t *cookie_prefix;
+                                // query string keys that will not be set in the cookie
+    apr_array_header_t *cookie_names;
+                                // like cookie_prefix, but the key must match exactly
+    apr_array_header_t *callback_prefixes;
+                                // check the callback against this list if it's not empty
+    int cache_ttl;              // seconds to cache responses for
+    int etag;                   // send an ETag, and honour If-None-Match?
+    int max_age;                // let browsers cache the response this long
+    int vary_cookie;            // send Vary: Cookie?
+    int timings;                // put the timings of every request in r->notes
+    int server_timing;          // send the timings in a Server-Timing header
+    int max_cookies;            // only look at this many cookies
+    int max_header_bytes;       // only look at this much of the Cookie header
+    int max_response_bytes;     // don't send more than this
+    int limit_action;           // what to do when one of the above is reached
+    int duplicates;             // what to do with cookies sent more than once
+    int format;                 // the response format; see FORMAT_JSON
+    int set_env;                // put the cookies in the environment
+    int configured;             // was any of the above set in this section?
+    plan_t *plan;               // all of the above, compiled. See compile_settings()
+} settings_rec;
+
+module AP_MODULE_DECLARE_DATA cookie2json_module;
+
+/* ********************************************
+
+    Scratch memory
+
+   ******************************************** */
+
+// Working memory that only lives while a request is being answered: decoded
+// values, the pairs, the duplicates table. Instead of taking it from r->pool
+// every time, each connection gets one block of C2JSONScratchSize bytes, the
+// first time it's needed, and every request on the connection starts using
+// it from the beginning again. Requests on a connection are handled one
+// after the other, and nothing that's still needed once the response has
+// been passed on lives here (anything a filter holds on to from a transient
+// bucket gets copied), so that's safe. Whatever doesn't fit comes from the
+// request pool instead, as before.
+#define SCRATCH_SIZE_DEFAULT    16384
+
+// C2JSONScratchSize; 0 means everything comes from the request pool
+static apr_size_t scratch_size = SCRATCH_SIZE_DEFAULT;
+
+// The scratch arena of the connection this request came in on, emptied.
+static scratch_t *scratch_for(request_rec *r)
+{
+    conn_rec *c    = r->connection;
+    scratch_t *sc  = ap_get_module_config( c->conn_config, &cookie2json_module );
+
+    if( !sc ) {
+        _DEBUG && fprintf( stderr, "New scratch arena of %" APR_SIZE_T_FMT " bytes\n",
+                                    scratch_size );
+
+        sc       = apr_pcalloc( c->pool, sizeof(scratch_t) );
+        sc->size = scratch_size;
+        sc->base = sc->size ? apr_palloc( c->pool, sc->size ) : NULL;
+
+        ap_set_module_config( c->conn_config, &cookie2json_module, sc );
+    }
+
+    sc->used     = 0;
+    sc->fallback = r->pool;
+
+    return sc;
+}
+
+/* ********************************************
+
+    Compiled settings
+
+   ******************************************** */
+
+/* Add a string to a hash; NULL and "" hash differently */
+static apr_uint64_t hash_string(apr_uint64_t h, const char *str)
+{
+    return str ? hash_bytes( hash_bytes( h, str, strlen(str) ), "", 1 )
+               : hash_bytes( h, "", 0 );
+}
+
+/* Add all the strings in a list to a hash */
+static apr_uint64_t hash_list(apr_uint64_t h, const apr_array_header_t *list)
+{
+    int i;
+
+    for( i = 0; i < list->nelts; i++ ) {
+        h = hash_string( h, ((const char **)list->elts)[i] );
+    }
+
+    return hash_bytes( h, "", 0 );
+}
+
+#define HASH_FIELD(h, plan, field)  hash_bytes( (h), &(plan)->field, sizeof((plan)->field) )
+
+/* Everything that influences the response goes into the fingerprint, as
+ * cached responses are only shared between plans with the same one. 'lists'
+ * stands in for the white lists, which the plan only has in compiled form.
+ * Every field is named here on purpose: when you add one to plan_t that
+ * changes the response, add it here too. */
+static apr_uint64_t plan_fingerprint(const plan_t *plan, apr_uint64_t lists)
+{
+    apr_uint64_t fp = lists;
+
+    fp = HASH_FIELD( fp, plan, enabled );
+    fp = HASH_FIELD( fp, plan, decode_values );
+    fp = HASH_FIELD( fp, plan, early );
+    fp = HASH_FIELD( fp, plan, jsonp );
+    fp = HASH_FIELD( fp, plan, etag );
+    fp = HASH_FIELD( fp, plan, vary_cookie );
+    fp = HASH_FIELD( fp, plan, timings );
+    fp = HASH_FIELD( fp, plan, server_timing );
+    fp = HASH_FIELD( fp, plan, duplicates );
+    fp = HASH_FIELD( fp, plan, format );
+    fp = HASH_FIELD( fp, plan, set_env );
+    fp = HASH_FIELD( fp, plan, cache_ttl );
+    fp = HASH_FIELD( fp, plan, max_cookies );
+    fp = HASH_FIELD( fp, plan, max_header_bytes );
+    fp = HASH_FIELD( fp, plan, max_response_bytes );
+    fp = HASH_FIELD( fp, plan, limit_action );
+    fp = hash_string( fp, plan->callback_name );
+    fp = hash_string( fp, plan->keys_name );
+    fp = hash_string( fp, plan->header_name );
+    fp = hash_string( fp, plan->placeholder );
+    fp = hash_string( fp, plan->cache_control );
+
+    return fp;
+}
+
+/* Turn the settings into a plan, with these (already compiled) white lists.
+ * 'lists' is a hash of the white lists, for the fingerprint. */
+static plan_t *make_plan(apr_pool_t *p, const settings_rec *cfg,
+                         const matcher_list_t *cookie_matchers,
+                         const matcher_list_t *callback_matchers,
+                         apr_uint64_t lists)
+{
+    plan_t *plan;
+
+    plan = (plan_t *) apr_pcalloc(p, sizeof(plan_t));
+    plan->enabled                   = cfg->enabled       == 1;
+    plan->decode_values             = cfg->decode_values == 1;
+    plan->early                     = cfg->early         == 1;
+    plan->etag                      = cfg->etag          == 1;
+    plan->vary_cookie               = cfg->vary_cookie   == 1;
+    plan->server_timing             = cfg->server_timing == 1;
+    plan->timings                   = cfg->timings != 0 || plan->server_timing;
+    plan->callback_name             = cfg->callback_name_from ? cfg->callback_name_from : "";
+    plan->callback_name_len         = strlen( plan->callback_name );
+    plan->jsonp                     = plan->callback_name_len > 0;
+    plan->keys_name                 = cfg->keys_from ? cfg->keys_from : "";
+    plan->keys_name_len             = strlen( plan->keys_name );
+    plan->header_name               = cfg->header_name;
+    plan->placeholder               = cfg->placeholder ? cfg->placeholder : "";
+    plan->placeholder_len           = strlen( plan->placeholder );
+    plan->cookie_matchers           = cookie_matchers;
+    plan->callback_matchers         = callback_matchers;
+    plan->respond                   = select_responder( plan );
+    plan->cache_ttl                 = apr_time_from_sec( cfg->cache_ttl > 0 ? cfg->cache_ttl : 0 );
+    plan->cache_control             = cfg->max_age == UNSET ? NULL
+                                    : apr_psprintf( p, "private, max-age=%d", cfg->max_age );
+    plan->max_cookies               = cfg->max_cookies        > 0 ? cfg->max_cookies        : 0;
+    plan->max_header_bytes          = cfg->max_header_bytes   > 0 ? cfg->max_header_bytes   : 0;
+    plan->max_response_bytes        = cfg->max_response_bytes > 0 ? cfg->max_response_bytes : 0;
+    plan->limit_action              = cfg->limit_action != UNSET ? cfg->limit_action : LIMIT_TRUNCATE;
+    plan->duplicates                = cfg->duplicates   != UNSET ? cfg->duplicates   : DUPLICATES_ALL;
+    plan->format                    = cfg->format       != UNSET ? cfg->format       : FORMAT_JSON;
+    plan->set_env                   = cfg->set_env       == 1;
+
+    plan->fingerprint               = plan_fingerprint( plan, lists );
+
+    return plan;
+}
+
+/* Compile the settings of a single section into a plan. This doesn't modify
+ * cfg, so it's safe to use on shared configs at request time as well. */
+static plan_t *compile_settings(apr_pool_t *p, const settings_rec *cfg)
+{
+    apr_uint64_t lists = hash_list( 0, cfg->cookie_prefix );
+    lists = hash_list( lists, cfg->cookie_names );
+    lists = hash_list( lists, cfg->callback_prefixes );
+
+    return make_plan( p, cfg,
+                      compile_matchers( p, cfg->cookie_prefix, cfg->cookie_names ),
+                      compile_matchers( p, cfg->callback_prefixes, NULL ),
+                      lists );
+}
+
+/* The plan to use for this request. Every section in the main config has
+ * been compiled in post_config(), and merged configs are compiled as they
+ * are merged, so this only has to do any work for configs we haven't seen
+ * before, which would be .htaccess files. */
+static const plan_t *request_plan(request_rec *r)
+{
+    settings_rec *cfg = ap_get_module_config( r->per_dir_config,
+                                              &cookie2json_module );
+
+    return cfg->plan ? cfg->plan : compile_settings( r->pool, cfg );
+}
+
+/* ********************************************
+
+    Response cache
+
+   ******************************************** */
+
+// An optional cache of rendered responses, shared by all threads in all child
+// processes. It's a fixed number of fixed size slots in shared memory, set up
+// in post_config() and inherited by the children. The slot for a response is
+// picked by its key: a hash of the plan's fingerprint, the Cookie header and
+// the callback. A newer response simply replaces whatever was in its slot.
+//
+// The key only picks the slot, and is a quick way to tell a miss. Every slot
+// also holds what its response was made for (see cache_req_t), and a hit has
+// to match that exactly, so a collision, or a key worked out by someone who
+// guessed the seed, never hands one client's cookies to another.
+//
+// There are no locks: every slot is a seqlock. A writer makes the sequence
+// number odd while it updates the slot (and gives up if it's odd already, as
+// someone else is writing), and even again when done. A reader copies the
+// slot, and only trusts the copy if the sequence number was even, and didn't
+// change, while it was copying.
+typedef struct {
+    volatile apr_uint32_t seq;  // odd while the slot is being written
+    apr_uint32_t len;           // length of the body
+    apr_uint64_t key;           // the response stored here; 0 if none
+    apr_time_t expires;         // when the response goes stale
+    apr_uint64_t etag;          // see response_etag()
+    apr_uint64_t fingerprint;   // the request it's for; see cache_req_t
+    apr_uint32_t format;
+    apr_uint32_t cookie_len;
+    apr_uint32_t callback_len;
+    apr_uint32_t keys_len;      // CACHE_NO_KEYS if none were asked for
+} cache_slot_t;                 // followed by entry_size bytes: the Cookie
+                                // header, callback and keys, then the body
+
+// A request, as far as the cache is concerned
+typedef struct {
+    apr_uint64_t fingerprint;   // of the plan
+    int format;                 // with C2JSONFormat auto, it isn't in the plan
+    const char *cookie_header;
+    apr_size_t cookie_len;
+    const char *callback;
+    apr_size_t callback_len;
+    const char *keys;           // NULL if none were asked for
+    apr_size_t keys_len;
+} cache_req_t;
+
+// asking for no keys at all is not the same as not asking
+#define CACHE_NO_KEYS       ((apr_uint32_t) -1)
+#define CACHE_KEYS_LEN(req) ((req)->keys ? (apr_uint32_t)(req)->keys_len : CACHE_NO_KEYS)
+
+#define CACHE_ENTRY_SIZE_DEFAULT    4096
+
+static struct {
+    apr_size_t entries;         // C2JSONCacheEntries; 0 means no cache
+    apr_size_t entry_size;      // C2JSONCacheEntrySize; max body size per slot
+    apr_size_t stride;          // bytes per slot, including the header
+    char *base;                 // the shared memory, or NULL if there is none
+    apr_uint64_t seed;          // random, so keys can't be predicted
+    volatile apr_uint32_t fence;
+                                // only used as a barrier, without GCC builtins
+} cache;
+
+// Memory ordering for the seqlocks. With GCC style builtins we can say exactly
+// what we need; otherwise, fall back on APR's atomics, which are full barriers.
+#if defined(__GNUC__)
+#define SEQ_LOAD(p)         __atomic_load_n( (p), __ATOMIC_ACQUIRE )
+#define SEQ_STORE(p, v)     __atomic_store_n( (p), (v), __ATOMIC_RELEASE )
+#define SEQ_READ_FENCE()    __atomic_thread_fence( __ATOMIC_ACQUIRE )
+#else
+#define SEQ_LOAD(p)         apr_atomic_cas32( (p), 0, 0 )
+#define SEQ_STORE(p, v)     apr_atomic_set32( (p), (v) )
+#define SEQ_READ_FENCE()    apr_atomic_cas32( &cache.fence, 0, 0 )
+#endif
+
+#define CACHE_SLOT(key)     ((cache_slot_t *)(cache.base + ((key) % cache.entries) * cache.stride))
+#define CACHE_DATA(slot)    ((char *)(slot) + sizeof(cache_slot_t))
+#define CACHE_REQ_LEN(req)  ((req)->cookie_len + (req)->callback_len + \
+                             ((req)->keys ? (req)->keys_len : 0))
+
+// Create a zeroed out shared memory segment, that lives as long as the config
+// does. 'what' is used for the file name, if one is needed, and for errors.
+static apr_status_t shm_create(apr_pool_t *pconf, server_rec *s, apr_size_t size,
+                               const char *what, void **base)
+{
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    // Anonymous shared memory is inherited by the children; if the platform
+    // doesn't have that, use a file backed segment instead.
+    rv = apr_shm_create( &shm, size, NULL, pconf );
+
+    if( APR_STATUS_IS_ENOTIMPL( rv ) ) {
+        const char *file = ap_server_root_relative( pconf,
+                                apr_pstrcat( pconf, "logs/c2json_", what, ".shm", NULL ) );
+
+        apr_shm_remove( file, pconf );
+        rv = apr_shm_create( &shm, size, file, pconf );
+    }
+
+    if( rv != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "mod_cookie2json: could not create %" APR_SIZE_T_FMT
+                      " bytes of shared memory for the %s", size, what );
+        return rv;
+    }
+
+    *base = apr_shm_baseaddr_get( shm );
+    memset( *base, 0, size );
+
+    return APR_SUCCESS;
+}
+
+// Create the shared memory for the cache, if one was configured
+static apr_status_t cache_create(apr_pool_t *pconf, server_rec *s)
+{
+    void *base;
+    apr_status_t rv;
+
+    cache.base = NULL;
+
+    if( !cache.entries ) {
+        return APR_SUCCESS;
+    }
+
+    cache.stride    = APR_ALIGN_DEFAULT( sizeof(cache_slot_t) + cache.entry_size );
+
+    rv = shm_create( pconf, s, cache.entries * cache.stride, "cache", &base );
+
+    if( rv != APR_SUCCESS ) {
+        return rv;
+    }
+
+    cache.base = base;
+
+    rv = apr_generate_random_bytes( (unsigned char *)&cache.seed, sizeof(cache.seed) );
+
+    return rv;
+}
+
+// The cache key for a response
+static apr_uint64_t cache_key(const cache_req_t *req)
+{
+    apr_uint64_t key = hash_bytes( cache.seed ^ req->fingerprint ^ req->format,
+                                   req->cookie_header, req->cookie_len );
+    key = hash_bytes( key, req->callback, req->callback_len );
+
+    const char asked = req->keys != NULL;
+    key = hash_bytes( key, &asked, 1 );
+
+    if( req->keys ) {
+        key = hash_bytes( key, req->keys, req->keys_len );
+    }
+
+    // 0 marks an empty slot
+    return key ? key : 1;
+}
+
+// Is this slot's response the one for this request? The lengths are checked
+// before anything is compared, so a slot that's being written while we look
+// can't make us read past its end.
+static int cache_slot_matches(const cache_slot_t *slot, apr_uint64_t key,
+                              const cache_req_t *req)
+{
+    const char *data = CACHE_DATA( slot );
+
+    if( slot->key != key || slot->fingerprint != req->fingerprint ||
+        slot->format != (apr_uint32_t) req->format ||
+        slot->cookie_len != req->cookie_len || slot->callback_len != req->callback_len ||
+        slot->keys_len != CACHE_KEYS_LEN( req ) ||
+        CACHE_REQ_LEN( req ) + slot->len > cache.entry_size
+    ) {
+        return 0;
+    }
+
+    if( memcmp( data, req->cookie_header, req->cookie_len ) != 0 ) {
+        return 0;
+    }
+
+    data += req->cookie_len;
+
+    if( memcmp( data, req->callback, req->callback_len ) != 0 ) {
+        return 0;
+    }
+
+    data += req->callback_len;
+
+    return !req->keys || memcmp( data, req->keys, req->keys_len ) == 0;
+}
+
+// Look up the response to a request in the cache. On a hit, a copy of the
+// body is returned (allocated from the pool), and its length and ETag put in
+// *len and *etag. NULL on a miss.
+static char *cache_fetch(apr_pool_t *pool, apr_uint64_t key, const cache_req_t *req,
+                         apr_time_t now, apr_size_t *len, apr_uint64_t *etag)
+{
+    cache_slot_t *slot = CACHE_SLOT( key );
+    apr_uint32_t seq   = SEQ_LOAD( &slot->seq );
+
+    // Being written, or not what we're looking for
+    if( (seq & 1) || slot->expires <= now || !cache_slot_matches( slot, key, req ) ) {
+        return NULL;
+    }
+
+    *len       = slot->len;
+    *etag      = slot->etag;
+    char *body = apr_palloc( pool, *len );
+    memcpy( body, CACHE_DATA( slot ) + CACHE_REQ_LEN( req ), *len );
+
+    // Make sure the comparison and the copy are complete before we check
+    // nobody changed the slot
+    SEQ_READ_FENCE();
+
+    if( slot->seq != seq ) {
+        return NULL;
+    }
+
+    return body;
+}
+
+// Store the response to a request that's in the brigade, of len bytes, in the
+// cache. If someone else is writing to the slot right now, we just don't bother.
+static void cache_store(apr_uint64_t key, const cache_req_t *req, apr_time_t expires,
+                        apr_uint64_t etag, apr_bucket_brigade *bb, apr_size_t len)
+{
+    cache_slot_t *slot = CACHE_SLOT( key );
+    apr_uint32_t seq   = slot->seq;
+    apr_size_t req_len = CACHE_REQ_LEN( req );
+
+    if( req_len > cache.entry_size || len > cache.entry_size - req_len || (seq & 1) ||
+        apr_atomic_cas32( &slot->seq, seq + 1, seq ) != seq
+    ) {
+        return;
+    }
+
+    // We own the slot now; readers will ignore it until we're done. Mark it
+    // empty first, in case the brigade can't be read.
+    slot->key = 0;
+
+    char *data = CACHE_DATA( slot );
+
+    memcpy( data, req->cookie_header, req->cookie_len );
+    data += req->cookie_len;
+    memcpy( data, req->callback, req->callback_len );
+    data += req->callback_len;
+
+    if( req->keys ) {
+        memcpy( data, req->keys, req->keys_len );
+        data += req->keys_len;
+    }
+
+    if( apr_brigade_flatten( bb, data, &len ) == APR_SUCCESS ) {
+        slot->len           = len;
+        slot->expires       = expires;
+        slot->etag          = etag;
+        slot->fingerprint   = req->fingerprint;
+        slot->format        = req->format;
+        slot->cookie_len    = req->cookie_len;
+        slot->callback_len  = req->callback_len;
+        slot->keys_len      = CACHE_KEYS_LEN( req );
+        slot->key           = key;
+    }
+
+    SEQ_STORE( &slot->seq, seq + 2 );
+}
+
+/* ********************************************
+
+    Statistics
+
+   ******************************************** */
+
+// Counters for every section that configures this module, kept in shared
+// memory so all children add to the same numbers. They're only ever updated
+// with atomic adds, so counting never takes a lock. Slot 0 is used for
+// anything that has no slot of its own, like .htaccess files.
+//
+// Latency is the time between the handler starting on a request and handing
+// off the response, in a histogram of powers of 2: bucket 0 is less than a
+// microsecond, bucket N is 2^(N-1) up to 2^N microseconds, and the last one
+// counts everything slower than that.
+#define STATS_LATENCY_BUCKETS   16
+
+#if defined(__GNUC__)
+typedef apr_uint64_t stat_counter_t;
+#define STAT_ADD(st, field, n)  __atomic_fetch_add( &(st)->field, (n), __ATOMIC_RELAXED )
+#define STAT_READ(counter)      __atomic_load_n( (counter), __ATOMIC_RELAXED )
+#else
+// APR only has 32 bit atomics; these wrap around sooner, but that's all
+typedef apr_uint32_t stat_counter_t;
+#define STAT_ADD(st, field, n)  apr_atomic_add32( &(st)->field, (apr_uint32_t)(n) )
+#define STAT_READ(counter)      apr_atomic_read32( (counter) )
+#endif
+
+typedef struct {
+    stat_counter_t requests;            // requests we answered, or tried to
+    stat_counter_t json;                // JSON responses sent
+    stat_counter_t jsonp;               // JSONP responses sent
+    stat_counter_t msgpack;             // MessagePack responses sent
+    stat_counter_t cbor;                // CBOR responses sent
+    stat_counter_t bad_callback;        // 400s because of the callback
+    stat_counter_t not_modified;        // If-None-Match matched our ETag
+    stat_counter_t cache_hits;          // answered from the response cache
+    stat_counter_t cookies_seen;        // pairs in the Cookie headers
+    stat_counter_t cookies_accepted;    // pairs that made it into a response
+    stat_counter_t cookies_dropped;     // pairs not on the white list
+    stat_counter_t bytes;               // response bytes sent
+    stat_counter_t limit_cookies;       // C2JSONMaxCookies was reached
+    stat_counter_t limit_header_bytes;  // C2JSONMaxHeaderBytes was reached
+    stat_counter_t limit_response_bytes;// C2JSONMaxResponseBytes was reached
+    stat_counter_t injected;            // responses the cookies were added to
+    stat_counter_t latency[STATS_LATENCY_BUCKETS];
+} stats_t;
+
+// Keep every slot on its own cache lines, so busy locations don't slow each
+// other down
+#define STATS_STRIDE    APR_ALIGN( sizeof(stats_t), 64 )
+
+static struct {
+    apr_array_header_t *names;  // the name of the section for every slot
+    char *base;                 // the shared memory, once it's created
+} stats;
+
+#define STATS_SLOT(slot)    ((stats_t *)(stats.base + (apr_size_t)(slot) * STATS_STRIDE))
+
+// The names of the slots so far; there's always slot 0
+static apr_array_header_t *stats_names(apr_pool_t *pconf)
+{
+    if( !stats.names ) {
+        stats.names = apr_array_make( pconf, 8, sizeof(const char *) );
+        *(const char **)apr_array_push( stats.names ) = "(other)";
+    }
+
+    return stats.names;
+}
+
+// Claim a slot for a section, named for the status page
+static int stats_add_slot(apr_pool_t *pconf, const char *name)
+{
+    *(const char **)apr_array_push( stats_names( pconf ) ) = name;
+
+    return stats.names->nelts - 1;
+}
+
+// Create the shared memory for the counters, once all slots are claimed
+static apr_status_t stats_create(apr_pool_t *pconf, server_rec *s)
+{
+    void *base;
+    apr_status_t rv;
+
+    rv = shm_create( pconf, s, stats_names( pconf )->nelts * STATS_STRIDE,
+                     "stats", &base );
+
+    if( rv != APR_SUCCESS ) {
+        return rv;
+    }
+
+    stats.base = base;
+
+    return APR_SUCCESS;
+}
+
+// The counters for a plan. Plans that were compiled while serving a request
+// may not have a slot, and share slot 0.
+static ALWAYS_INLINE stats_t *stats_for(const plan_t *plan)
+{
+    return STATS_SLOT( plan->stats_slot );
+}
+
+// Count the time spent on a request
+static void stats_latency(stats_t *st, apr_interval_time_t elapsed)
+{
+    int bucket = 0;
+
+    while( elapsed > 0 && bucket < STATS_LATENCY_BUCKETS - 1 ) {
+        elapsed >>= 1;
+        bucket++;
+    }
+
+    STAT_ADD( st, latency[bucket], 1 );
+}
+
+// Count a response we're about to send
+static ALWAYS_INLINE void stats_response(stats_t *st, apr_interval_time_t elapsed,
+                                         int format, apr_size_t callback_len,
+                                         apr_size_t body_len)
+{
+    if( format == FORMAT_MSGPACK ) {
+        STAT_ADD( st, msgpack, 1 );
+    } else if( format == FORMAT_CBOR ) {
+        STAT_ADD( st, cbor, 1 );
+    } else if( callback_len ) {
+        STAT_ADD( st, jsonp, 1 );
+    } else {
+        STAT_ADD( st, json, 1 );
+    }
+
+    STAT_ADD( st, bytes, body_len );
+    stats_latency( st, elapsed );
+}
+
+// The phases of a request that are timed with C2JSONTimings. As each phase
+// ends, the clock is read once; phases that were skipped take 0us.
+enum { PHASE_CALLBACK, PHASE_PARSE, PHASE_FILTER, PHASE_EMIT, PHASES };
+
+static const char *phase_notes[PHASES] = {
+    "c2json_callback_us", "c2json_parse_us", "c2json_filter_us", "c2json_emit_us"
+};
+
+// How a request went, for the counters, the notes and Server-Timing
+typedef struct {
+    apr_time_t start;                   // when we started on the request
+    apr_time_t last;                    // when the last timed phase ended
+    apr_interval_time_t took[PHASES];   // microseconds spent per phase
+    int cookies;                        // pairs in the Cookie header
+    int returned;                       // pairs in the response
+} progress_t;
+
+#define END_PHASE(plan, pr, phase) do {                 \
+    if( (plan)->timings ) {                             \
+        apr_time_t now_     = apr_time_now();           \
+        (pr)->took[phase]   = now_ - (pr)->last;        \
+        (pr)->last          = now_;                     \
+    }                                                   \
+} while( 0 )
+
+// Make the timings available to mod_log_config, as %{c2json_parse_us}n etc,
+// and, if asked for, to the client in a Server-Timing header.
+static void publish_timings(request_rec *r, const plan_t *plan,
+                            const progress_t *pr, apr_size_t body_len)
+{
+    int i;
+
+    for( i = 0; i < PHASES; i++ ) {
+        apr_table_setn( r->notes, phase_notes[i],
+                        apr_psprintf( r->pool, "%" APR_TIME_T_FMT, pr->took[i] ) );
+    }
+
+    apr_table_setn( r->notes, "c2json_cookies",          apr_itoa( r->pool, pr->cookies ) );
+    apr_table_setn( r->notes, "c2json_cookies_returned", apr_itoa( r->pool, pr->returned ) );
+    apr_table_setn( r->notes, "c2json_bytes",            apr_off_t_toa( r->pool, body_len ) );
+
+    // Server-Timing durations are in milliseconds
+    if( plan->server_timing ) {
+        #define MS(us) (us) / 1000, (int)((us) % 1000)
+
+        apr_table_mergen( r->headers_out, "Server-Timing", apr_psprintf( r->pool,
+            "c2json-callback;dur=%" APR_TIME_T_FMT ".%03d, "
+            "c2json-parse;dur=%"    APR_TIME_T_FMT ".%03d, "
+            "c2json-filter;dur=%"   APR_TIME_T_FMT ".%03d, "
+            "c2json-emit;dur=%"     APR_TIME_T_FMT ".%03d",
+            MS( pr->took[PHASE_CALLBACK] ), MS( pr->took[PHASE_PARSE] ),
+            MS( pr->took[PHASE_FILTER] ),   MS( pr->took[PHASE_EMIT] ) ) );
+
+        #undef MS
+    }
+}
+
+/* ********************************************
+
+    Request handling
+
+   ******************************************** */
+
+// The parameters we're interested in, out of the query string. They point
+// straight into r->args, unless they had to be percent-decoded into the
+// scratch arena, and are NOT NUL terminated; use the lengths.
+typedef struct {
+    const char *callback;       // "" if there was none
+    apr_size_t callback_len;
+    const char *keys;           // NULL if there was none
+    apr_size_t keys_len;
+} query_params_t;
+
+// Is this key from the query string the parameter called 'name'?
+#define PARAM_IS(key, key_len, name, name_len) \
+    ((key_len) == (name_len) && strncasecmp( (key), (name), (key_len) ) == 0)
+
+// Look for the callback and the list of keys in the query string, and
+// validate the callback, in a single pass that stops as soon as everything
+// we're after has been found. Nothing is allocated, unless a value we use
+// has to be percent-decoded, which goes in 'sc'. On success, OK is returned and 'params' is
+// filled in; an invalid callback gives HTTP_BAD_REQUEST.
+// 'want_callback' and 'check_prefix' are constants in every caller; see
+// RESPONDER().
+static ALWAYS_INLINE int scan_query(request_rec *r, scratch_t *sc, const plan_t *plan,
+                                    query_params_t *params,
+                                    int want_callback, const int check_prefix)
+{
+    params->callback        = "";
+    params->callback_len    = 0;
+    params->keys            = NULL;
+    params->keys_len        = 0;
+
+    int want_keys = plan->keys_name_len > 0;
+
+    // No query string? nothing to do here
+    if( !r->args ) {
+        return OK;
+    }
+
+    const char *cursor = r->args;
+    const char *end    = cursor + strlen( cursor );
+
+    // Iterate over the pairs in the query string, until we have what we need.
+    // In the example of 'b=2&c=3' this will give 'b=2' then 'c=3'
+    while( cursor < end && (want_callback || want_keys) ) {
+        const char *amp      = memchr( cursor, '&', end - cursor );
+        const char *pair_end = amp ? amp : end;
+        const char *key      = cursor;
+        const char *equals   = memchr( key, '=', pair_end - key );
+
+        cursor = pair_end + 1;
+
+        _DEBUG && fprintf( stderr, "Query string pair: %.*s\n",
+                                    (int)(pair_end - key), key );
+
+        // Does not contains a =, or starts with a =, meaning it's garbage
+        if( !equals || equals == key ) {
+            continue;
+        }
+
+        // So this IS a key value pair; the key is everything up to the first
+        // =, and the value everything after it.
+        apr_size_t key_len   = equals - key;
+        const char *value    = equals + 1;
+        apr_size_t value_len = pair_end - value;
+
+        // This might be the callback name - the first one counts
+        if( want_callback &&
+            PARAM_IS( key, key_len, plan->callback_name, plan->callback_name_len )
+        ) {
+            value = url_decode( sc, value, value_len, &value_len );
+
+            _DEBUG && fprintf( stderr, "validating callback %.*s\n", (int)value_len, value );
+
+            // validate the callback to avoid script injection under some circumstances
+            const char *current = find_invalid_callback_char( value, value + value_len );
+
+            // found a bad char
+            if( current != value + value_len ) {
+                _DEBUG && fprintf( stderr, "found unsafe character %c in JSONP callback %.*s; returning 400\n", *current, (int)value_len, value);
+                return HTTP_BAD_REQUEST;
+            }
+
+            // check that it's allowed by the prefix list, if there is one
+            if( check_prefix &&
+                !matchers_match( plan->callback_matchers, value, value_len )
+            ) {
+                _DEBUG && fprintf( stderr, "found disallowed callback %.*s in JSONP; returning 400\n", (int)value_len, value);
+                return HTTP_BAD_REQUEST;
+            }
+
+            // ok, this is our callback
+            params->callback     = value;
+            params->callback_len = value_len;
+            want_callback        = 0;
+
+            _DEBUG && fprintf(stderr, "using %.*s as the callback name\n", (int)value_len, value);
+
+        // Or it's the list of cookies to return - the first one counts
+        } else if( want_keys &&
+                   PARAM_IS( key, key_len, plan->keys_name, plan->keys_name_len )
+        ) {
+            params->keys = url_decode( sc, value, value_len, &params->keys_len );
+            want_keys    = 0;
+
+            _DEBUG && fprintf(stderr, "only returning cookies %.*s\n",
+                                      (int)params->keys_len, params->keys);
+        }
+    }
+
+    return OK;
+}
+
+// The media types in an Accept header that say which format a client wants.
+// Wildcards only count for JSON; a binary format has to be asked for by name.
+static const struct {
+    const char *type;
+    apr_size_t len;
+    int format;
+} accept_types[] = {
+#define ACCEPT_TYPE(type, format)   { type, CONST_LEN(type), format }
+    ACCEPT_TYPE( "application/msgpack",     FORMAT_MSGPACK ),
+    ACCEPT_TYPE( "application/x-msgpack",   FORMAT_MSGPACK ),
+    ACCEPT_TYPE( "application/vnd.msgpack", FORMAT_MSGPACK ),
+    ACCEPT_TYPE( "application/cbor",        FORMAT_CBOR    ),
+    ACCEPT_TYPE( "application/json",        FORMAT_JSON    ),
+    ACCEPT_TYPE( "application/javascript",  FORMAT_JSON    ),
+    ACCEPT_TYPE( "text/javascript",         FORMAT_JSON    ),
+    ACCEPT_TYPE( "application/*",           FORMAT_JSON    ),
+    ACCEPT_TYPE( "text/*",                  FORMAT_JSON    ),
+    ACCEPT_TYPE( "*/*",                     FORMAT_JSON    ),
+#undef ACCEPT_TYPE
+};
+
+// The q value of a media range in an Accept header, in thousandths, from the
+// parameters that follow it in [p, end). Without one (or with a malformed
+// one) that's 1000.
+static int accept_quality(const char *p, const char *end)
+{
+    while( (p = memchr( p, ';', end - p )) ) {
+        for( p++; p < end && apr_isspace(*p); p++ );
+
+        if( end - p < 2 || apr_tolower(p[0]) != 'q' || p[1] != '=' ) {
+            continue;
+        }
+
+        p += 2;
+
+        if( p < end && *p == '0' ) {
+            int q     = 0;
+            int scale = 100;
+
+            if( ++p < end && *p == '.' ) {
+                for( p++; p < end && apr_isdigit(*p) && scale; p++, scale /= 10 ) {
+                    q += (*p - '0') * scale;
+                }
+            }
+
+            return q;
+        }
+
+        return 1000;
+    }
+
+    return 1000;
+}
+
+// The format to respond in. That's the one configured, unless that's auto;
+// then it's the one the Accept header likes best. JSON wins ties, and is what
+// you get without an Accept header, or with one that likes none of them.
+static int request_format(request_rec *r, const plan_t *plan)
+{
+    if( plan->format != FORMAT_AUTO ) {
+        return plan->format;
+    }
+
+    const char *accept = apr_table_get( r->headers_in, "Accept" );
+
+    if( !accept ) {
+        return FORMAT_JSON;
+    }
+
+    int quality[FORMAT_AUTO] = { 0 };
+    const char *cursor       = accept;
+    const char *end          = accept + strlen( accept );
+    int format               = FORMAT_JSON;
+    apr_size_t i;
+
+    // Media ranges are separated by commas, and their parameters by ;'s
+    while( cursor < end ) {
+        const char *comma     = memchr( cursor, ',', end - cursor );
+        const char *range_end = comma ? comma : end;
+        const char *type      = cursor;
+
+        cursor = range_end + 1;
+
+        while( type < range_end && apr_isspace(*type) ) {
+            type++;
+        }
+
+        const char *type_end = type;
+
+        while( type_end < range_end && *type_end != ';' && !apr_isspace(*type_end) ) {
+            type_end++;
+        }
+
+        for( i = 0; i < sizeof(accept_types) / sizeof(accept_types[0]); i++ ) {
+            if( (apr_size_t)(type_end - type) == accept_types[i].len &&
+                strncasecmp( type, accept_types[i].type, accept_types[i].len ) == 0
+            ) {
+                int q = accept_quality( type_end, range_end );
+
+                if( q > quality[ accept_types[i].format ] ) {
+                    quality[ accept_types[i].format ] = q;
+                }
+
+                break;
+            }
+        }
+    }
+
+    for( i = FORMAT_MSGPACK; i < FORMAT_AUTO; i++ ) {
+        if( quality[i] > quality[format] ) {
+            format = (int)i;
+        }
+    }
+
+    _DEBUG && fprintf( stderr, "Accept: %s gives %s\n", accept, formats[format].name );
+
+    return format;
+}
+
+// A strong ETag for the response: a hash of exactly what goes into the body
+// (the pairs, as they will be escaped, and the callback) and of the plan's
+// fingerprint and the format, as the same cookies can give a different body
+// elsewhere. For JSON, the format doesn't change the hash at all. The
+// seed is fixed, so the ETag is the same on every server and after restarts.
+#define ETAG_SEED   0x636F6F6B69653273ULL
+
+static apr_uint64_t response_etag(const plan_t *plan, int format,
+                                  const apr_array_header_t *pairs,
+                                  const char *callback, apr_size_t callback_len)
+{
+    apr_uint64_t h = hash_bytes( ETAG_SEED ^ plan->fingerprint ^ format,
+                                 callback, callback_len );
+    int i;
+
+    for( i = 0; pairs && i < pairs->nelts; i++ ) {
+        const cookie_pair_t *pair = &((const cookie_pair_t *)pairs->elts)[i];
+
+        const cookie_pair_t *more;
+
+        // the number of values goes in too, or 'a=1; a=2; a=3' with
+        // C2JSONDuplicates array would hash the same as 'a=1; 2=3'
+        h = hash_bytes( h, &pair->values, sizeof(pair->values) );
+        h = hash_bytes( h, pair->key,   pair->key_len );
+        h = hash_bytes( h, pair->value, pair->value_len );
+
+        for( more = pair->more; more; more = more->more ) {
+            h = hash_bytes( h, more->value, more->value_len );
+        }
+    }
+
+    return h;
+}
+
+// Set the validators & caching headers for the response. If an ETag is sent
+// and the client already has this exact response, it needn't be built at
+// all: HTTP_NOT_MODIFIED is returned instead of OK.
+static int set_cache_headers(request_rec *r, const plan_t *plan, apr_uint64_t etag)
+{
+    if( plan->cache_control ) {
+        apr_table_setn( r->headers_out, "Cache-Control", plan->cache_control );
+    }
+
+    if( plan->vary_cookie ) {
+        apr_table_mergen( r->headers_out, "Vary", "Cookie" );
+    }
+
+    // the same URL gives a different format depending on the Accept header
+    if( plan->format == FORMAT_AUTO ) {
+        apr_table_mergen( r->headers_out, "Vary", "Accept" );
+    }
+
+    if( !plan->etag ) {
+        return OK;
+    }
+
+    apr_table_setn( r->headers_out, "ETag",
+                    apr_psprintf( r->pool, "\"%016" APR_UINT64_T_HEX_FMT "\"", etag ) );
+
+    // This handles If-None-Match (and If-Match, etc) exactly like the core
+    // does for static files, including 304 vs 412 depending on the method.
+    int rv = ap_meets_conditions( r );
+
+    _DEBUG && rv != OK && fprintf( stderr, "ETag matched for %s: %d\n", r->uri, rv );
+
+    if( rv == HTTP_NOT_MODIFIED ) {
+        STAT_ADD( stats_for( plan ), not_modified, 1 );
+    }
+
+    return rv;
+}
+
+// Send the brigade with the response body to the client
+static int send_body(request_rec *r, apr_bucket_brigade *bucket_brigade,
+                     int format, apr_size_t body_len)
+{
+    // note that this is end of stream - no more data after this bucket
+    APR_BRIGADE_INSERT_TAIL( bucket_brigade,
+                             apr_bucket_eos_create( bucket_brigade->bucket_alloc ) );
+
+    // We know exactly how big the body is, so tell the client. That keeps
+    // keep-alive working without the core having to count the buckets.
+    ap_set_content_length( r, body_len );
+
+    // Set the content type, now that we have a working response
+    // This has to be done /before/ passing the brigade off.
+    // Note, this can't be set using an 'apr_table_addn( r->headers_out .. )
+    // because it will be overwritten by the core:
+    // ./server/config.c: handler = r->content_type ? r->content_type : ap_default_type(r);
+    // Instead, set it directly on r:
+    r->content_type = formats[format].content_type;
+
+    // pass the brigade - we're done
+    apr_status_t rv;
+    rv = ap_pass_brigade( r->output_filters, bucket_brigade );
+    apr_brigade_cleanup( bucket_brigade );
+
+    if (rv != APR_SUCCESS ) {
+        _DEBUG && fprintf( stderr,
+                       "mod_cookie2json: ap_pass_brigade failed for %s", r->uri );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return OK;
+}
+
+// Count the response, publish the timings and send it
+static int send_response(request_rec *r, const plan_t *plan, const progress_t *pr,
+                         apr_bucket_brigade *bucket_brigade, int format,
+                         apr_size_t callback_len, apr_size_t body_len)
+{
+    apr_time_t end = plan->timings ? pr->last : apr_time_now();
+
+    stats_response( stats_for( plan ), end - pr->start, format, callback_len, body_len );
+
+    if( plan->timings ) {
+        publish_timings( r, plan, pr, body_len );
+    }
+
+    return send_body( r, bucket_brigade, format, body_len );
+}
+
+// Build and send the response for this request, once the handler or the quick
+// handler have decided we should be answering. The flags say which parts of
+// the work this location needs at all; every combination gets its own copy of
+// this function (see RESPONDER() below), with the branches for work that isn't
+// needed compiled out.
+#define RESPOND_WHITELIST       0x1     // there's a C2JSONPrefix/C2JSONName list
+#define RESPOND_CALLBACK        0x2     // there's a C2JSONCallBackNameFrom
+#define RESPOND_CALLBACK_PREFIX 0x4     // there's a C2JSONCallBackPrefix list
+
+static ALWAYS_INLINE int respond_with(request_rec *r, const plan_t *plan,
+                                      const int flags)
+{
+    // create bucket & bucket brigade, following the code in:
+    // http://svn.apache.org/repos/asf/httpd/httpd/trunk/modules/generators/mod_asis.c
+    apr_bucket_brigade *bucket_brigade;
+
+    // the connection to the client
+    conn_rec *conn = r->connection;
+
+    // where to count this request
+    stats_t *st     = stats_for( plan );
+    progress_t pr   = { 0 };
+
+    // working memory for this request
+    scratch_t *sc   = scratch_for( r );
+
+    pr.start        = apr_time_now();
+    pr.last         = pr.start;
+
+    STAT_ADD( st, requests, 1 );
+
+    // ********************************
+    // Is there a callback, or a list of keys?
+    // ********************************
+
+    query_params_t params = { "", 0, NULL, 0 };
+
+    if( (flags & RESPOND_CALLBACK) || plan->keys_name_len ) {
+        int rv = scan_query( r, sc, plan, &params, flags & RESPOND_CALLBACK,
+                             flags & RESPOND_CALLBACK_PREFIX );
+
+        if( rv != OK ) {
+            STAT_ADD( st, bad_callback, 1 );
+            return rv;
+        }
+
+        END_PHASE( plan, &pr, PHASE_CALLBACK );
+    }
+
+    // ********************************
+    // What format does the client want?
+    // ********************************
+
+    // A callback only means something for JSON; the binary formats ignore it
+    const int format        = request_format( r, plan );
+    const char *callback    = format == FORMAT_JSON ? params.callback : "";
+    apr_size_t callback_len = (flags & RESPOND_CALLBACK) && format == FORMAT_JSON
+                            ? params.callback_len : 0;
+
+    // create a brigade for the body we're about to return
+    bucket_brigade = apr_brigade_create( r->pool, conn->bucket_alloc );
+
+    // ********************************
+    // Parse the cookie
+    // ********************************
+
+    // See if we have any cookies being sent to us. See next_cookie_pair()
+    // for all the formats we support.
+    const char *cookie_header = apr_table_get( r->headers_in, "Cookie" );
+
+    // nothing to see here, move along. The response is always the same, so
+    // send it straight from the constant.
+    if( !cookie_header && !callback_len ) {
+        _DEBUG && fprintf( stderr, "No cookie header present\n" );
+
+        apr_uint64_t etag = plan->etag ? response_etag( plan, format, NULL, "", 0 ) : 0;
+        int rv            = set_cache_headers( r, plan, etag );
+
+        if( rv != OK ) {
+            return rv;
+        }
+
+        APR_BRIGADE_INSERT_TAIL( bucket_brigade, apr_bucket_immortal_create(
+            formats[format].empty, formats[format].empty_len, bucket_brigade->bucket_alloc ) );
+
+        return send_response( r, plan, &pr, bucket_brigade, format, 0,
+                              formats[format].empty_len );
+    }
+
+    // ********************************
+    // Is this too much work?
+    // ********************************
+
+    apr_size_t header_len = cookie_header ? strlen( cookie_header ) : 0;
+
+    if( plan->max_header_bytes && header_len > plan->max_header_bytes ) {
+        _DEBUG && fprintf( stderr, "Cookie header over %" APR_SIZE_T_FMT " bytes\n",
+                                    plan->max_header_bytes );
+
+        STAT_ADD( st, limit_header_bytes, 1 );
+
+        if( plan->limit_action != LIMIT_TRUNCATE ) {
+            return plan->limit_action;
+        }
+
+        header_len = cut_header( cookie_header, plan->max_header_bytes );
+    }
+
+    // ********************************
+    // Have we answered this before?
+    // ********************************
+
+    apr_uint64_t key = 0;
+    cache_req_t cache_req;
+
+    if( plan->cache_ttl && cache.base && cookie_header ) {
+        apr_size_t cached_len;
+        apr_uint64_t cached_etag;
+
+        cache_req.fingerprint   = plan->fingerprint;
+        cache_req.format        = format;
+        cache_req.cookie_header = cookie_header;
+        cache_req.cookie_len    = strlen( cookie_header );
+        cache_req.callback      = callback;
+        cache_req.callback_len  = callback_len;
+        cache_req.keys          = params.keys;
+        cache_req.keys_len      = params.keys_len;
+
+        key = cache_key( &cache_req );
+
+        char *cached = cache_fetch( r->pool, key, &cache_req, r->request_time,
+                                    &cached_len, &cached_etag );
+
+        if( cached ) {
+            _DEBUG && fprintf( stderr, "cache hit for %s\n", r->uri );
+
+            int rv = set_cache_headers( r, plan, cached_etag );
+
+            if( rv != OK ) {
+                return rv;
+            }
+
+            STAT_ADD( st, cache_hits, 1 );
+
+            EMIT_SLICE( bucket_brigade, cached, cached_len );
+            return send_response( r, plan, &pr, bucket_brigade, format,
+                                  callback_len, cached_len );
+        }
+    }
+
+    apr_array_header_t pairs_on_stack;
+    apr_array_header_t *pairs = scratch_pairs( sc, &pairs_on_stack, header_len,
+                                               plan->max_cookies );
+
+    if( cookie_header ) {
+        if( parse_pairs( cookie_header, header_len, pairs, plan->max_cookies ) ) {
+            STAT_ADD( st, limit_cookies, 1 );
+
+            if( plan->limit_action != LIMIT_TRUNCATE ) {
+                return plan->limit_action;
+            }
+        }
+
+        pr.cookies = pairs->nelts;
+
+        END_PHASE( plan, &pr, PHASE_PARSE );
+
+        // The names asked for go in a small hash table, so checking every
+        // cookie against them takes the same time however many there are.
+        keyset_t keyset;
+
+        if( params.keys ) {
+            keyset_init( &keyset, params.keys, params.keys_len );
+        }
+
+        filter_pairs( sc, plan->cookie_matchers, plan->decode_values, pairs,
+                      params.keys ? &keyset : NULL, format, flags & RESPOND_WHITELIST );
+
+        if( plan->duplicates != DUPLICATES_ALL ) {
+            dedupe_pairs( sc, plan->duplicates, pairs );
+        }
+
+        pr.returned = pairs->nelts;
+
+        END_PHASE( plan, &pr, PHASE_FILTER );
+
+        STAT_ADD( st, cookies_seen,     pr.cookies );
+        STAT_ADD( st, cookies_accepted, pr.returned );
+        STAT_ADD( st, cookies_dropped,  pr.cookies - pr.returned );
+    }
+
+    // ********************************
+    // How big will the response be?
+    // ********************************
+
+    apr_size_t body_len = measure_response( pairs, format, callback_len );
+
+    _DEBUG && fprintf( stderr, "body will be %" APR_SIZE_T_FMT " bytes\n", body_len );
+
+    if( plan->max_response_bytes && body_len > plan->max_response_bytes ) {
+        STAT_ADD( st, limit_response_bytes, 1 );
+
+        if( plan->limit_action != LIMIT_TRUNCATE ) {
+            return plan->limit_action;
+        }
+
+        // Leave out cookies from the end until it fits. Without any cookies
+        // left the body looks different, so measure that from scratch.
+        while( body_len > plan->max_response_bytes && pairs->nelts > 1 ) {
+            body_len -= drop_last_pair( pairs, format );
+        }
+
+        if( body_len > plan->max_response_bytes ) {
+            pairs->nelts = 0;
+            body_len     = measure_response( pairs, format, callback_len );
+        }
+
+        // Not even an empty response fits (think of a long callback), so
+        // there is nothing left to truncate
+        if( body_len > plan->max_response_bytes ) {
+            _DEBUG && fprintf( stderr, "empty response of %" APR_SIZE_T_FMT " bytes is over the limit\n",
+                                        body_len );
+
+            return HTTP_BAD_REQUEST;
+        }
+
+        pr.returned = pairs->nelts;
+    }
+
+    // ********************************
+    // Does the client have it already?
+    // ********************************
+
+    // Only hash if we need to. The ETag is stored in the response cache along
+    // with the body, so a cache hit doesn't need the pairs to recompute it.
+    apr_uint64_t etag = plan->etag ? response_etag( plan, format, pairs, callback, callback_len ) : 0;
+    int rv            = set_cache_headers( r, plan, etag );
+
+    if( rv != OK ) {
+        return rv;
+    }
+
+    // ********************************
+    // Create the response
+    // ********************************
+
+    // fill the brigade with the response, fragment by fragment.
+    emit_response( bucket_brigade, pairs, format, callback, callback_len );
+
+    END_PHASE( plan, &pr, PHASE_EMIT );
+
+    if( key ) {
+        cache_store( key, &cache_req, r->request_time + plan->cache_ttl, etag,
+                     bucket_brigade, body_len );
+    }
+
+    // ********************************
+    // Send back the body
+    // ********************************
+
+    return send_response( r, plan, &pr, bucket_brigade, format, callback_len, body_len );
+}
+
+// Stamp out a responder for a combination of flags
+#define RESPONDER(name, flags) \
+    static int name(request_rec *r, const plan_t *plan) \
+    {   return respond_with( r, plan, (flags) ); }
+
+RESPONDER( respond_json,                    0 )
+RESPONDER( respond_json_whitelist,          RESPOND_WHITELIST )
+RESPONDER( respond_jsonp,                   RESPOND_CALLBACK )
+RESPONDER( respond_jsonp_whitelist,         RESPOND_CALLBACK | RESPOND_WHITELIST )
+RESPONDER( respond_jsonp_prefix,            RESPOND_CALLBACK | RESPOND_CALLBACK_PREFIX )
+RESPONDER( respond_jsonp_prefix_whitelist,  RESPOND_CALLBACK | RESPOND_CALLBACK_PREFIX |
+                                            RESPOND_WHITELIST )
+
+// Pick the responder that does exactly the work this plan needs
+static respond_fn select_responder(const plan_t *plan)
+{
+    static const respond_fn responders[] = {
+        respond_json,           respond_json_whitelist,
+        respond_jsonp,          respond_jsonp_whitelist,
+        respond_jsonp_prefix,   respond_jsonp_prefix_whitelist,
+    };
+
+    // a callback prefix without a callback to check doesn't do anything
+    int index = (plan->cookie_matchers ? 1 : 0) +
+                (!plan->jsonp ? 0 : plan->callback_matchers ? 4 : 2);
+
+    return responders[ index ];
+}
+
+// The regular handler; by the time we get here the request has been through
+// the whole pipeline: translate_name, map_to_storage, auth, fixups, etc.
+static int hook(request_rec *r)
+{
+    const plan_t *plan = request_plan( r );
+
+    /* Do not run in subrequests, don't run if not enabled */
+    if( !(plan->enabled || r->main) ) {
+        return DECLINED;
+    }
+
+    // It's a HEAD request, nothing we want to return here.
+    if( r->header_only ) {
+        return DECLINED;
+    }
+
+    return plan->respond( r, plan );
+}
+
+// Set if C2JSONEarly is turned on anywhere in the config, so the quick handler
+// can get out of the way immediately on servers that don't use it. Reset for
+// every (re)load of the config in pre_config().
+static int early_configured = 0;
+
+// The quick handler runs straight after the request line and headers are read,
+// before any of the translate_name, map_to_storage (directory walks, .htaccess
+// lookups), auth or fixups phases. As our response only depends on the request
+// headers, locations with C2JSONEarly On are answered from here.
+static int early_hook(request_rec *r, int lookup_uri)
+{
+    if( !early_configured ) {
+        return DECLINED;
+    }
+
+    /* Do not run in subrequests or lookups */
+    if( lookup_uri || r->main ) {
+        return DECLINED;
+    }
+
+    // It's a HEAD request, nothing we want to return here.
+    if( r->header_only ) {
+        return DECLINED;
+    }
+
+    // The per-directory config hasn't been worked out yet at this point, so do
+    // the <Location> walk ourselves. Note that r->uri hasn't been unescaped or
+    // normalized yet, and that <If> sections aren't looked at; see the
+    // DOCUMENTATION of C2JSONEarly.
+    //
+    // If we decline, the core does its own walk, and merges its result onto
+    // whatever r->per_dir_config is by then. For an unchanged r->uri it reuses
+    // the sections we found, but a URI that normalizing changed ('%2e', '/../')
+    // is walked from scratch, and merging that onto our result would apply
+    // sections twice. So put back the config we started from before declining.
+    ap_conf_vector_t *per_dir_config = r->per_dir_config;
+
+    if( ap_location_walk( r ) != OK ) {
+        r->per_dir_config = per_dir_config;
+        return DECLINED;
+    }
+
+    const plan_t *plan = request_plan( r );
+
+    if( !(plan->enabled && plan->early) ) {
+        r->per_dir_config = per_dir_config;
+        return DECLINED;
+    }
+
+    _DEBUG && fprintf( stderr, "answering %s from the quick handler\n", r->uri );
+
+    // Other modules (mod_headers, mod_deflate, ...) add their output filters
+    // from the insert_filter hook, which normally runs right before the
+    // handler. Give them the same chance here.
+    ap_run_insert_filter( r );
+
+    return plan->respond( r, plan );
+}
+
+// The counters as shown on the status page, in order
+static const struct {
+    const char *name;           // for machine readable output
+    const char *label;          // for people
+    apr_size_t offset;
+} stats_fields[] = {
+    { "Requests",           "Requests",         APR_OFFSETOF(stats_t, requests)         },
+    { "JSON",               "JSON",             APR_OFFSETOF(stats_t, json)             },
+    { "JSONP",              "JSONP",            APR_OFFSETOF(stats_t, jsonp)            },
+    { "MessagePack",        "MessagePack",      APR_OFFSETOF(stats_t, msgpack)          },
+    { "CBOR",               "CBOR",             APR_OFFSETOF(stats_t, cbor)             },
+    { "BadCallbacks",       "Bad callbacks",    APR_OFFSETOF(stats_t, bad_callback)     },
+    { "NotModified",        "Not modified",     APR_OFFSETOF(stats_t, not_modified)     },
+    { "CacheHits",          "Cache hits",       APR_OFFSETOF(stats_t, cache_hits)       },
+    { "CookiesSeen",        "Cookies seen",     APR_OFFSETOF(stats_t, cookies_seen)     },
+    { "CookiesAccepted",    "Cookies accepted", APR_OFFSETOF(stats_t, cookies_accepted) },
+    { "CookiesDropped",     "Cookies dropped",  APR_OFFSETOF(stats_t, cookies_dropped)  },
+    { "Bytes",              "Bytes sent",       APR_OFFSETOF(stats_t, bytes)            },
+    { "LimitCookies",       "Cookie limit",     APR_OFFSETOF(stats_t, limit_cookies)    },
+    { "LimitHeaderBytes",   "Header limit",     APR_OFFSETOF(stats_t, limit_header_bytes)   },
+    { "LimitResponseBytes", "Response limit",   APR_OFFSETOF(stats_t, limit_response_bytes) },
+    { "Injected",           "Injected",         APR_OFFSETOF(stats_t, injected)         },
+};
+
+#define STATS_FIELD(st, i)  ((apr_uint64_t) STAT_READ( \
+                                (stat_counter_t *)((char *)(st) + stats_fields[i].offset) ))
+
+// The counters, in the style of mod_status: 'SetHandler c2json-status' in a
+// <Location> gives an HTML page, and adding '?auto' to the URL gives a plain
+// text version that's easy to parse: a 'Location:' line for every section,
+// followed by 'Name: value' lines for its counters. The latency histogram is
+// one line of comma separated counts; see STATS_LATENCY_BUCKETS.
+static int status_hook(request_rec *r)
+{
+    int i, j;
+
+    if( !r->handler || strcmp( r->handler, "c2json-status" ) != 0 || !stats.base ) {
+        return DECLINED;
+    }
+
+    int machine = r->args && ap_strstr_c( r->args, "auto" ) != NULL;
+
+    ap_set_content_type( r, machine ? "text/plain; charset=ISO-8859-1"
+                                    : "text/html; charset=ISO-8859-1" );
+
+    if( r->header_only ) {
+        return OK;
+    }
+
+    int slots = stats.names->nelts;
+
+    if( machine ) {
+        for( i = 0; i < slots; i++ ) {
+            stats_t *st = STATS_SLOT( i );
+
+            ap_rprintf( r, "Location: %s\n", ((const char **)stats.names->elts)[i] );
+
+            for( j = 0; j < (int)(sizeof(stats_fields) / sizeof(stats_fields[0])); j++ ) {
+                ap_rprintf( r, "%s: %" APR_UINT64_T_FMT "\n",
+                            stats_fields[j].name, STATS_FIELD( st, j ) );
+            }
+
+            ap_rputs( "Latency: ", r );
+
+            for( j = 0; j < STATS_LATENCY_BUCKETS; j++ ) {
+                ap_rprintf( r, "%s%" APR_UINT64_T_FMT, j ? "," : "",
+                            (apr_uint64_t) STAT_READ( &st->latency[j] ) );
+            }
+
+            ap_rputs( "\n", r );
+        }
+
+        return OK;
+    }
+
+    ap_rputs( DOCTYPE_HTML_3_2
+              "<html><head>\n<title>mod_cookie2json status</title>\n</head><body>\n"
+              "<h1>mod_cookie2json status</h1>\n"
+              "<h2>Requests</h2>\n<table border=\"1\">\n<tr><th>Location</th>", r );
+
+    for( j = 0; j < (int)(sizeof(stats_fields) / sizeof(stats_fields[0])); j++ ) {
+        ap_rprintf( r, "<th>%s</th>", stats_fields[j].label );
+    }
+
+    ap_rputs( "</tr>\n", r );
+
+    for( i = 0; i < slots; i++ ) {
+        stats_t *st = STATS_SLOT( i );
+
+        ap_rprintf( r, "<tr><td>%s</td>",
+                    ap_escape_html( r->pool, ((const char **)stats.names->elts)[i] ) );
+
+        for( j = 0; j < (int)(sizeof(stats_fields) / sizeof(stats_fields[0])); j++ ) {
+            ap_rprintf( r, "<td>%" APR_UINT64_T_FMT "</td>", STATS_FIELD( st, j ) );
+        }
+
+        ap_rputs( "</tr>\n", r );
+    }
+
+    ap_rputs( "</table>\n<h2>Latency</h2>\n<table border=\"1\">\n<tr><th>Location</th>", r );
+
+    for( j = 0; j < STATS_LATENCY_BUCKETS - 1; j++ ) {
+        ap_rprintf( r, "<th>&lt;%uus</th>", 1u << j );
+    }
+
+    ap_rprintf( r, "<th>&gt;=%uus</th></tr>\n", 1u << (STATS_LATENCY_BUCKETS - 2) );
+
+    for( i = 0; i < slots; i++ ) {
+        stats_t *st = STATS_SLOT( i );
+
+        ap_rprintf( r, "<tr><td>%s</td>",
+                    ap_escape_html( r->pool, ((const char **)stats.names->elts)[i] ) );
+
+        for( j = 0; j < STATS_LATENCY_BUCKETS; j++ ) {
+            ap_rprintf( r, "<td>%" APR_UINT64_T_FMT "</td>",
+                        (apr_uint64_t) STAT_READ( &st->latency[j] ) );
+        }
+
+        ap_rputs( "</tr>\n", r );
+    }
+
+    ap_rputs( "</table>\n</body></html>\n", r );
+
+    return OK;
+}
+
+/* Forget about the previous config on startup and graceful restarts */
+static int pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    early_configured = 0;
+
+    cache.entries    = 0;
+    cache.entry_size = CACHE_ENTRY_SIZE_DEFAULT;
+
+    scratch_size     = SCRATCH_SIZE_DEFAULT;
+
+    stats.names      = NULL;
+    stats.base       = NULL;
+
+    return OK;
+}
+
+/* ********************************************
+
+    Cookies for other modules
+
+   ******************************************** */
+
+// The cookies of a request, parsed once and kept in r->request_config, for
+// C2JSONHeader & C2JSONPlaceholder, C2JSONSetEnv and, through the optional
+// functions in mod_cookie2json.h, other modules.
+typedef struct {
+    apr_array_header_t *pairs;  // on the white list, decoded and deduplicated,
+                                // in order, and measured for JSON
+    apr_hash_t *values;         // name -> NUL terminated value
+} request_cookies_t;
+
+// The cookies of this request, as they'd go in a response, except for the
+// ones asked for with C2JSONKeysFrom. The limits always truncate, as there's
+// no request of our own to refuse. This is kept for the rest of the request,
+// so it doesn't use the scratch arena, which the next request on the
+// connection reuses. That also keeps it clear of any buckets that might
+// still point there, when it's called from the middle of a response.
+static request_cookies_t *request_cookies(request_rec *r)
+{
+    request_cookies_t *rc = ap_get_module_config( r->request_config, &cookie2json_module );
+
+    if( rc ) {
+        return rc;
+    }
+
+    const plan_t *plan          = request_plan( r );
+    scratch_t sc                = { NULL, 0, 0, r->pool };
+    const char *cookie_header   = apr_table_get( r->headers_in, "Cookie" );
+    apr_size_t header_len       = cookie_header ? strlen( cookie_header ) : 0;
+    int i;
+
+    rc          = apr_palloc( r->pool, sizeof(request_cookies_t) );
+    rc->pairs   = apr_array_make( r->pool, 16, sizeof(cookie_pair_t) );
+    rc->values  = apr_hash_make( r->pool );
+
+    if( plan->max_header_bytes && header_len > plan->max_header_bytes ) {
+        header_len = cut_header( cookie_header, plan->max_header_bytes );
+    }
+
+    if( cookie_header ) {
+        parse_pairs( cookie_header, header_len, rc->pairs, plan->max_cookies );
+
+        filter_pairs( &sc, plan->cookie_matchers, plan->decode_values, rc->pairs,
+                      NULL, FORMAT_JSON, plan->cookie_matchers != NULL );
+
+        if( plan->duplicates != DUPLICATES_ALL ) {
+            dedupe_pairs( &sc, plan->duplicates, rc->pairs );
+        }
+    }
+
+    // The first value wins; with C2JSONDuplicates last, that's been swapped
+    // for the last one already.
+    for( i = 0; i < rc->pairs->nelts; i++ ) {
+        const cookie_pair_t *pair = &((const cookie_pair_t *)rc->pairs->elts)[i];
+
+        if( !apr_hash_get( rc->values, pair->key, pair->key_len ) ) {
+            apr_hash_set( rc->values, pair->key, pair->key_len,
+                          apr_pstrmemdup( r->pool, pair->value, pair->value_len ) );
+        }
+    }
+
+    _DEBUG && fprintf( stderr, "%d cookies for %s\n", rc->pairs->nelts, r->uri );
+
+    ap_set_module_config( r->request_config, &cookie2json_module, rc );
+
+    return rc;
+}
+
+// The optional functions; see mod_cookie2json.h
+static apr_hash_t *c2json_cookies(request_rec *r)
+{
+    return request_cookies( r )->values;
+}
+
+static const char *c2json_cookie_get(request_rec *r, const char *name)
+{
+    return apr_hash_get( request_cookies( r )->values, name, APR_HASH_KEY_STRING );
+}
+
+// C2JSONSetEnv: the cookies go in the environment as C2JSON_<name>, for CGI
+// scripts, SSI, mod_rewrite's %{ENV:...}, logging etc. This runs in fixups,
+// once the config of the request is known, right before the handler.
+#define SET_ENV_PREFIX  "C2JSON_"
+
+// This gets the cookies through the optional functions, exactly like another
+// module would, so the tests of C2JSONSetEnv cover mod_cookie2json.h as well.
+static APR_OPTIONAL_FN_TYPE(c2json_cookies)     *cookies_fn;
+static APR_OPTIONAL_FN_TYPE(c2json_cookie_get)  *cookie_get_fn;
+
+static void retrieve_optional_fn(void)
+{
+    cookies_fn      = APR_RETRIEVE_OPTIONAL_FN( c2json_cookies );
+    cookie_get_fn   = APR_RETRIEVE_OPTIONAL_FN( c2json_cookie_get );
+}
+
+static int set_env_hook(request_rec *r)
+{
+    const plan_t *plan = request_plan( r );
+
+    if( !plan->set_env || !cookies_fn || !cookie_get_fn ) {
+        return DECLINED;
+    }
+
+    apr_hash_index_t *hi;
+
+    for( hi = apr_hash_first( r->pool, cookies_fn( r ) ); hi; hi = apr_hash_next( hi ) ) {
+        const void *key;
+        apr_ssize_t key_len;
+
+        apr_hash_this( hi, &key, &key_len, NULL );
+
+        const char *name = apr_pstrmemdup( r->pool, key, key_len );
+
+        apr_table_setn( r->subprocess_env,
+                        apr_pstrcat( r->pool, SET_ENV_PREFIX, name, NULL ),
+                        cookie_get_fn( r, name ) );
+    }
+
+    return OK;
+}
 
 /* ********************************************
 
-    Structs & Defines
+    Injecting into other responses
 
    ******************************************** */
 
-#ifdef DEBUG                    // To print diagnostics to the error log
-#define _DEBUG 1                // enable through gcc -DDEBUG
-#else
-#define _DEBUG 0
-#endif
+// With C2JSONHeader and/or C2JSONPlaceholder, the cookies are added to the
+// responses of other handlers (static files, mod_proxy, ...) by an output
+// filter, instead of having a location of their own: as a response header,
+// and/or in place of the placeholder in an HTML page. That saves the browser
+// a request per page.
+#define INJECT_FILTER   "C2JSON_INJECT"
+
+// The JSON for the cookies in this request, as respond_with() would send it
+// without a callback: a NUL terminated string from the request pool, of *len
+// bytes. See request_cookies(). NULL if not even an empty map fits within
+// C2JSONMaxResponseBytes.
+static char *render_json(request_rec *r, const plan_t *plan, apr_size_t *len)
+{
+    // a copy of the array header, so leaving pairs out doesn't touch the original
+    apr_array_header_t list     = *request_cookies( r )->pairs;
+    apr_array_header_t *pairs   = &list;
 
+    apr_size_t body_len = measure_body( pairs, 0 );
 
-// mapping from ascii position to T/F allows [.0-9A-Z_a-z] see: http://www.asciitable.com/
-static const char valid_callback_char_table[] = {
-        // null to -
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0,
-
-        1, // .
-        0, // /
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0-9
-        0, 0, 0, 0, 0, 0, 0, // : to @
-
-        // A - Z
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1,
-
-        0, 0, 0, 0, // [ to ^
-        1, // _
-        0, // `
-
-        // a - z
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1,
-
-        // ( to the end
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0
-};
+    if( plan->max_response_bytes ) {
+        while( body_len > plan->max_response_bytes && pairs->nelts > 1 ) {
+            body_len -= drop_last_pair( pairs, FORMAT_JSON );
+        }
 
-// module configuration - this is basically a global struct
-typedef struct {
-    int enabled;                // module enabled?
-    char *callback_name_from;   // use this query string keys value as the callback
-    apr_array_header_t *cookie_prefix;
-                                // query string keys that will not be set in the cookie
-    apr_array_header_t *callback_prefixes;
-                                // check the callback against this list if it's not empty
-} settings_rec;
+        if( body_len > plan->max_response_bytes ) {
+            pairs->nelts = 0;
+            body_len     = measure_body( pairs, 0 );
+        }
 
-module AP_MODULE_DECLARE_DATA cookie2json_module;
+        if( body_len > plan->max_response_bytes ) {
+            return NULL;
+        }
+    }
 
-// See here for the structure of request_rec:
-// http://ci.apache.org/projects/httpd/trunk/doxygen/structrequest__rec.html
-static int hook(request_rec *r)
+    // Render it exactly like a response, and flatten that
+    apr_bucket_brigade *bb  = apr_brigade_create( r->pool, r->connection->bucket_alloc );
+    char *json              = apr_palloc( r->pool, body_len + 1 );
+
+    emit_body( bb, pairs, "", 0 );
+
+    apr_brigade_flatten( bb, json, &body_len );
+    apr_brigade_destroy( bb );
+
+    json[body_len] = '\0';
+    *len           = body_len;
+
+    _DEBUG && fprintf( stderr, "cookies for %s: %s\n", r->uri, json );
+
+    return json;
+}
+
+// Make JSON safe to put anywhere in an HTML page, even inside a <script>, by
+// escaping '<', '>' and '&'. Those only ever occur inside strings, where the
+// \u escapes mean exactly the same thing. Returns json itself if there's
+// nothing to escape; otherwise a copy from the pool. *len is updated.
+static const char *html_safe_json(apr_pool_t *pool, const char *json, apr_size_t *len)
 {
-    settings_rec *cfg = ap_get_module_config( r->per_dir_config,
-                                              &cookie2json_module );
+    static const char hex[] = "0123456789abcdef";
+    const char *end         = json + *len;
+    const char *p           = find_any( json, end, '<', '>', '&' );
+    apr_size_t count        = 0;
 
-    /* Do not run in subrequests, don't run if not enabled */
-    if( !(cfg->enabled || r->main) ) {
-        return DECLINED;
+    if( p == end ) {
+        return json;
     }
 
-    // It's a HEAD request, nothing we want to return here.
-    if( r->header_only ) {
-        return DECLINED;
+    for( ; p < end; p = find_any( p + 1, end, '<', '>', '&' ) ) {
+        count++;
     }
 
-    // the response body
-    char *body = "";
+    // each of them becomes \u00XX; 5 more bytes
+    char *safe  = apr_palloc( pool, *len + count * 5 + 1 );
+    char *out   = safe;
 
-    // ********************************
-    // Parse the cookie
-    // ********************************
+    for( p = json; p < end; ) {
+        const char *special = find_any( p, end, '<', '>', '&' );
 
-    // See if we have any cookies being sent to us. If the client sent a single
-    // cookie header with multiple values, they will be split by a ; For example:
-    // Cookie: a=1; b=2
-    // However, if the client sent multiple cookie headers, with a single value
-    // each, they'll be split by a , For example:
-    // Cookie: a=1, b=2
-    // A combination of the above is also possible, so we might receive a string
-    // like: a=1, b=2; c=3
-    // Support all these cases.
+        memcpy( out, p, special - p );
+        out += special - p;
 
-    const char *cookie_header;
-    if( (cookie_header = apr_table_get(r->headers_in, "Cookie")) ){
+        if( special == end ) {
+            break;
+        }
+
+        memcpy( out, "\\u00", 4 );
+        out[4]  = hex[ (unsigned char)*special >> 4 ];
+        out[5]  = hex[ *special & 0xF ];
+        out    += 6;
+        p       = special + 1;
+    }
 
-        _DEBUG && fprintf( stderr, "Cookie header: %s\n", cookie_header );
+    *out = '\0';
+    *len = out - safe;
 
-        // Iterate over each cookie: directive sent
-        char *last_cookie;
-        char *cookie = apr_strtok(
-                            apr_pstrdup( r->pool, cookie_header ), ",", &last_cookie );
+    return safe;
+}
 
-        // in the example of 'a=1, b=2; c=3', this gives 'a=1' and then 'b=2; c=3'
-        while( cookie != NULL ) {
+// The state of the filter for a response
+typedef struct {
+    const char *json;           // what goes in place of the placeholder
+    apr_size_t json_len;
+    apr_size_t held;            // the last bytes we saw were the start of the
+                                // placeholder; this many of them are held back
+    int done;                   // replaced it, or not looking for it at all
+} inject_ctx_t;
+
+// When the bytes after the 'held' ones turn out not to finish the placeholder,
+// the held ones may still end with the start of another one (think of 'aab'
+// in 'aaab'). Returns how many of them to keep holding back.
+static apr_size_t placeholder_restart(const char *placeholder, apr_size_t held)
+{
+    apr_size_t keep;
 
-            // This MAY contain leading whitespace. Let's get rid of that. I'd use
-            // apr_collapse_spaces, but it removes /all/ whitespace :(
-            // this will return NULL if there's no match, so then just use the
-            // original.
-            while( isspace(*cookie) ) { cookie++; }
+    for( keep = held - 1; keep > 0; keep-- ) {
+        if( memcmp( placeholder + held - keep, placeholder, keep ) == 0 ) {
+            break;
+        }
+    }
 
-            _DEBUG && fprintf( stderr, "Individual cookie: %s\n", cookie );
+    return keep;
+}
 
-            // protect against the pathological case where the cookie is malformed
-            // and there's no length left on the cookie now.
-            if( !strlen(cookie) ) {
-                // And get the next cookie -- has to be done at every break
-                cookie = apr_strtok( NULL, ",", &last_cookie );
+// Put bytes that were held back into the response, before bucket b. They are
+// the start of the placeholder, so they're taken from there.
+static void release_held(const plan_t *plan, inject_ctx_t *ctx, apr_bucket *b,
+                         apr_size_t count)
+{
+    APR_BUCKET_INSERT_BEFORE( b, apr_bucket_transient_create(
+                                    plan->placeholder, count, b->list ) );
 
-                continue;
-            }
+    ctx->held -= count;
+}
 
-            // Now, iterate over the pairs in the individual cookie directives.
-            // In the example of 'b=2; c=3' this will give 'b=2' then 'c=3'
-            char *last_pair;
-            char *pair = apr_strtok( apr_pstrdup( r->pool, cookie ), ";", &last_pair );
+// Put the cookies in place of the placeholder, which is bucket b, exactly
+static void replace_placeholder(request_rec *r, const plan_t *plan, inject_ctx_t *ctx,
+                                apr_bucket *b)
+{
+    _DEBUG && fprintf( stderr, "injecting cookies into %s\n", r->uri );
 
-            while( pair != NULL ) {
+    APR_BUCKET_INSERT_BEFORE( b, apr_bucket_pool_create(
+                                    ctx->json, ctx->json_len, r->pool, b->list ) );
+    apr_bucket_delete( b );
 
-                // This MAY contain leading whitespace. Let's get rid of that. I'd use
-                // apr_collapse_spaces, but it removes /all/ whitespace :(
-                // this will return NULL if there's no match, so then just use the
-                // original.
-                while( isspace(*pair) ) { pair++; }
+    // a response with the header was counted already
+    if( !plan->header_name ) {
+        STAT_ADD( stats_for( plan ), injected, 1 );
+    }
 
-                _DEBUG && fprintf( stderr, "Individual pair: %s\n", pair );
+    ctx->done = 1;
+}
 
-                // From here on, actually process the pairs
+// Is the body encoded (compressed)? Handlers set that in any of three places.
+static int encoded(request_rec *r)
+{
+    const char *codings[3];
+    int i;
 
-                // length of the substr before the = sign (or index of the = sign)
-                int contains_equals_at = strcspn( pair, "=" );
+    codings[0] = r->content_encoding;
+    codings[1] = apr_table_get( r->headers_out,     "Content-Encoding" );
+    codings[2] = apr_table_get( r->err_headers_out, "Content-Encoding" );
 
-                // Does not contains a =, or starts with a =, meaning it's garbage
-                if( !strstr(pair, "=") || contains_equals_at < 1 ) {
+    for( i = 0; i < 3; i++ ) {
+        if( codings[i] && *codings[i] && strcasecmp( codings[i], "identity" ) != 0 ) {
+            return 1;
+        }
+    }
 
-                    // And get the next pair -- has to be done at every break
-                    pair = apr_strtok( NULL, ";", &last_pair );
+    return 0;
+}
 
-                    continue;
-                }
+// The first time round, work out what to do with the cookies. Only if there's
+// anything to do, work out the cookies themselves. Returns NULL if there
+// isn't: no header, and not a page we can put them in.
+static inject_ctx_t *inject_start(ap_filter_t *f, const plan_t *plan)
+{
+    request_rec *r      = f->r;
 
-                // So this IS a key value pair. Let's get the key and the value.
-                // first, get the key - everything up to the first =
-                char *key   = apr_pstrndup( r->pool, pair, contains_equals_at );
+    // We can only find the placeholder in HTML that isn't compressed
+    int in_body         = plan->placeholder_len && r->content_type &&
+                          strncasecmp( r->content_type, "text/html", CONST_LEN("text/html") ) == 0 &&
+                          !encoded( r );
 
-                // now get the value, everything AFTER the = sign. We do that by
-                // moving the pointer past the = sign.
-                char *value = apr_pstrdup( r->pool, pair );
-                value += contains_equals_at + 1;
+    if( !plan->header_name && !in_body ) {
+        _DEBUG && fprintf( stderr, "nothing to inject into %s\n", r->uri );
+        return NULL;
+    }
 
-                // Are you whitelisting based on prefixes? If so, let's make sure
-                // this key is ok.
-                // Following tutorial code here again:
-                // http://xrl.us/AprTutorial
-                int i;
-                int is_whitelisted = 0;
-                for( i = 0; i < cfg->cookie_prefix->nelts; i++ ) {
+    apr_size_t len;
+    char *json          = render_json( r, plan, &len );
 
-                    char *prefix = ((char **)cfg->cookie_prefix->elts)[i];
+    if( !json ) {
+        return NULL;
+    }
 
-                    _DEBUG && fprintf( stderr,
-                                        "checking white list prefix: %s\n", prefix );
+    inject_ctx_t *ctx   = apr_pcalloc( r->pool, sizeof(inject_ctx_t) );
 
-                    //it's indeed whiteliested, we should use this value instead
-                    if( strncasecmp( key, prefix, strlen(prefix) ) == 0 ) {
-                        _DEBUG && fprintf( stderr,
-                            "Cookie %s is white listed against %s\n", pair, prefix );
+    f->ctx = ctx;
 
-                        is_whitelisted++;
-                        break;
-                    }
-                }
+    if( plan->header_name ) {
+        apr_table_setn( r->headers_out, plan->header_name, json );
 
-                // if there was a white list but we didn't find a match for this key,
-                // we have to skip it
-                if( !(apr_is_empty_array( cfg->cookie_prefix )) && !is_whitelisted ) {
-                    _DEBUG && fprintf( stderr,
-                        "Cookie %s is not on the whitelist - skipping\n", pair );
+        STAT_ADD( stats_for( plan ), injected, 1 );
+    }
 
-                    // And get the next pair -- has to be done at every break
-                    pair = apr_strtok( NULL, ";", &last_pair );
+    // The response now depends on the cookies, so it mustn't be handed to
+    // other visitors by a shared cache. Unless the handler said otherwise,
+    // make it private altogether.
+    apr_table_mergen( r->headers_out, "Vary", "Cookie" );
 
-                    continue;
-                }
+    if( !apr_table_get( r->headers_out, "Cache-Control" ) ) {
+        apr_table_setn( r->headers_out, "Cache-Control", "private" );
+    }
 
+    if( !in_body ) {
+        ctx->done = 1;
+        return ctx;
+    }
 
-                body = apr_pstrcat( r->pool,
-                            body,           // what we have so far
-                             // If we already have pairs in here, we need the
-                             // delimiter, otherwise we don't.
-                             (strlen(body) ? ", " : "" ),
-                             // Quote the key/values - could contain anything
-                             "\"", key,      "\": ",
-                             "\"", value,    "\"",
-                            NULL
-                        );
+    ctx->json       = html_safe_json( r->pool, json, &len );
+    ctx->json_len   = len;
 
-                // And get the next pair -- has to be done at every break
-                pair = apr_strtok( NULL, ";", &last_pair );
-            }
+    // The body is now different for every visitor: it has a different length,
+    // and the validators of the original would let a browser keep showing a
+    // page with old cookies in it.
+    apr_table_unset( r->headers_out, "Content-Length" );
+    apr_table_unset( r->headers_out, "ETag" );
+    apr_table_unset( r->headers_out, "Last-Modified" );
 
-            // And get the next cookie -- has to be done at every break
-            cookie = apr_strtok( NULL, ",", &last_cookie );
-        }
+    return ctx;
+}
 
-    // nothing to see here, move along
-    } else {
-        _DEBUG && fprintf( stderr, "No cookie header present\n" );
+// The output filter. It sets the header right away, before any of the body
+// goes out, and then looks for the first occurrence of the placeholder in the
+// body, which can be spread over any number of buckets and brigades.
+static apr_status_t inject_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    request_rec *r          = f->r;
+    const plan_t *plan      = request_plan( r );
+    inject_ctx_t *ctx       = f->ctx ? f->ctx : inject_start( f, plan );
+    const char *placeholder = plan->placeholder;
+    apr_size_t plen         = plan->placeholder_len;
+    apr_bucket *b, *next;
+
+    // Nothing (more) to do for this response; get out of the way
+    if( !ctx || ctx->done ) {
+        ap_remove_output_filter( f );
+        return ap_pass_brigade( f->next, bb );
     }
 
-    _DEBUG && fprintf( stderr, "body will contain: %s\n", body );
+    for( b = APR_BRIGADE_FIRST( bb );
+         b != APR_BRIGADE_SENTINEL( bb ) && !ctx->done;
+         b = next
+    ) {
+        next = APR_BUCKET_NEXT( b );
 
-    // ********************************
-    // Is there a callback?
-    // ********************************
+        // Whatever was held back is not going to be the placeholder after all
+        if( APR_BUCKET_IS_METADATA( b ) ) {
+            if( ctx->held ) {
+                release_held( plan, ctx, b, ctx->held );
+            }
 
-    char *callback = "";
+            continue;
+        }
 
-    // No callback name configured, or no query string? nothing to do here
-    if( strlen(cfg->callback_name_from) && r->args && strlen( r->args ) > 1 ) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t rv = apr_bucket_read( b, &data, &len, APR_BLOCK_READ );
 
-        // Now, iterate over the pairs in the individual cookie directives.
-        // In the example of 'b=2; c=3' this will give 'b=2' then 'c=3'
-        char *last_pair;
-        char *pair = apr_strtok( apr_pstrdup( r->pool, r->args ), "&", &last_pair );
+        if( rv != APR_SUCCESS ) {
+            return rv;
+        }
 
-        while( pair != NULL ) {
+        // Do these bytes finish the placeholder that was started before?
+        while( ctx->held ) {
+            apr_size_t need = plen - ctx->held;
 
-            _DEBUG && fprintf( stderr, "Query string pair: %s\n", pair );
+            if( memcmp( data, placeholder + ctx->held, len < need ? len : need ) == 0 ) {
+                break;
+            }
 
-            // length of the substr before the = sign (or index of the = sign)
-            int contains_equals_at = strcspn( pair, "=" );
+            release_held( plan, ctx, b,
+                          ctx->held - placeholder_restart( placeholder, ctx->held ) );
+        }
 
-            // Does not contains a =, or starts with a =, meaning it's garbage
-            if( !strstr(pair, "=") || contains_equals_at < 1 ) {
+        if( ctx->held ) {
+            apr_size_t need = plen - ctx->held;
 
-                // And get the next pair -- has to be done at every break
-                pair = apr_strtok( NULL, "=", &last_pair );
+            if( len < need ) {
+                ctx->held += len;
+                apr_bucket_delete( b );
                 continue;
             }
 
-            // So this IS a key value pair. Let's get the key and the value.
-            // first, get the key - everything up to the first =
-            char *key   = apr_pstrndup( r->pool, pair, contains_equals_at );
+            // The held bytes are gone already, so this takes care of all of it
+            ctx->held = 0;
 
-            // now get the value, everything AFTER the = sign. We do that by
-            // moving the pointer past the = sign.
-            char *value = apr_pstrdup( r->pool, pair );
-            value += contains_equals_at + 1;
-
-            _DEBUG && fprintf( stderr, "qs pair=%s, key=%s, value=%s\n",
-                                        pair, key, value );
-
-            // This might be the callback name - if so we're done
-            if( cfg->callback_name_from && !(strlen( callback )) &&
-                strcasecmp( key, cfg->callback_name_from ) == 0
-            ) {
-                _DEBUG && fprintf( stderr, "validating callback %s\n", value);
-
-                // validate the callback to avoid script injection under some circumstances
-                char *current = value;
-                while (*current && valid_callback_char_table[*current]) *current++;
-
-                // didn't find a bad char
-                if( *current == '\0' ) {
-                    _DEBUG && fprintf( stderr, "validating the callback %s against prefixes\n", value);
-
-                    int i;
-                    int allowed = 1; // Assume it's allowed initially
-                    // now, check that it's allowed by the prefix list
-                    for( i = 0; i < cfg->callback_prefixes->nelts; i++ ) {
-                        allowed = 0; // There's at least one prefix, so mark not allowed until validated.
-
-                        const char *prefix = ((char **)cfg->callback_prefixes->elts)[i];
-                        _DEBUG && fprintf(stderr, "checking callback %s against prefix: %s\n", value, prefix);
-
-                        // check if the value starts with a white-listed prefix.
-                        if( strncasecmp( value, prefix, strlen(prefix) ) == 0 ) {
-                            _DEBUG && fprintf( stderr, "callback %s is allowed %s\n", value, prefix );
-
-                            allowed = 1;
-                            break;
-                        }
-                    }
-
-                    if (!allowed) {
-                        _DEBUG && fprintf( stderr, "found disallowed callback %s in JSONP; returning 400\n", value);
-                        return HTTP_BAD_REQUEST;
-                    }
-
-                    // ok, this is our callback
-                    callback = value;
-                    _DEBUG && fprintf(stderr, "using %s as the callback name\n", callback);
-                    break;
-                } else {
-                    _DEBUG && fprintf( stderr, "found unsafe character %c in JSONP callback %s; returning 400\n", *current, value);
-                    return HTTP_BAD_REQUEST;
-                }
+            if( len > need ) {
+                apr_bucket_split( b, need );
             }
 
-            // And get the next pair -- has to be done at every break
-            pair = apr_strtok( NULL, "&", &last_pair );
-            continue;
+            replace_placeholder( r, plan, ctx, b );
+            break;
         }
-    }
 
-    // ********************************
-    // Create the response
-    // ********************************
+        // Look for the whole placeholder, or the start of it at the very end
+        const char *end = data + len;
+        const char *p   = data;
 
-    body = apr_pstrcat( r->pool, "{ ", body, " }", NULL );
+        for( ; (p = memchr( p, placeholder[0], end - p )); p++ ) {
+            apr_size_t left = end - p;
 
-    // you want it wrapped in a callback?
-    if( strlen( callback ) ) {
-        body = apr_pstrcat( r->pool, callback, "({\n",
-                                "  status: 200,\n",
-                                "  body: ", body, "\n",
-                                "});",
-                                NULL );
-    }
+            if( memcmp( p, placeholder, left < plen ? left : plen ) == 0 ) {
+                break;
+            }
+        }
 
-    // ********************************
-    // Send back the body
-    // ********************************
+        if( !p ) {
+            continue;
+        }
 
-    // create bucket & bucket brigade, following the code in:
-    // http://svn.apache.org/repos/asf/httpd/httpd/trunk/modules/generators/mod_asis.c
-    apr_bucket_brigade *bucket_brigade;
-    apr_bucket *bucket;
-    apr_bucket *eos_bucket;
+        if( p > data ) {
+            apr_bucket_split( b, p - data );
+            b = APR_BUCKET_NEXT( b );
+        }
 
-    // the connection to the client
-    conn_rec *conn = r->connection;
+        if( (apr_size_t)(end - p) < plen ) {
+            ctx->held = end - p;
+            apr_bucket_delete( b );
+            continue;
+        }
 
-    // create a brigade for the body we're about to return.
-    bucket_brigade = apr_brigade_create( r->pool, conn->bucket_alloc );
+        if( (apr_size_t)(end - p) > plen ) {
+            apr_bucket_split( b, plen );
+        }
 
-    // XXX apr_brigade_puts / apr_brigade_writev seems the 'right' way to
-    // do this, but I can't figure out what the 'flush' and 'ctx' arguments
-    // to the function are supposed to be. Documentation isn't helping and
-    // google doesn't offer anything useful either :(
-    // http://www.apachetutor.org/dev/brigades
-    // http://www.cs.virginia.edu/~jcw5q/talks/apache/bucketbrigades.ac2002.pdf
-
-    // create a bucket for the body we're about to return.
-    bucket      = apr_bucket_pool_create(
-                        body,
-                        (apr_size_t) (strlen(body)),
-                        r->pool,
-                        conn->bucket_alloc
-                    );
+        replace_placeholder( r, plan, ctx, b );
+    }
 
-    // note that this is end of stream - no more data after this bucket
-    eos_bucket  = apr_bucket_eos_create( conn->bucket_alloc );
+    if( ctx->done ) {
+        ap_remove_output_filter( f );
+    }
 
-    // and append
-    APR_BRIGADE_INSERT_TAIL( bucket_brigade, bucket );
-    APR_BRIGADE_INSERT_TAIL( bucket_brigade, eos_bucket );
+    return ap_pass_brigade( f->next, bb );
+}
 
-    // Set the content type, now that we have a working JSON response
-    // This has to be done /before/ passing the brigade off.
-    // Note, this can't be set using an 'apr_table_addn( r->headers_out .. )
-    // because it will be overwritten by the core:
-    // ./server/config.c: handler = r->content_type ? r->content_type : ap_default_type(r);
-    // Instead, set it directly on r:
-    r->content_type = "text/javascript";
+// Add the filter to responses in locations that want the cookies. Also called
+// by early_hook() for requests it answers itself.
+static void insert_filter(request_rec *r)
+{
+    if( r->main ) {
+        return;
+    }
 
-    // pass the brigade - we're done
-    apr_status_t rv;
-    rv = ap_pass_brigade( r->output_filters, bucket_brigade );
-    apr_brigade_cleanup( bucket_brigade );
+    const plan_t *plan = request_plan( r );
 
-    if (rv != APR_SUCCESS ) {
-        _DEBUG && fprintf( stderr,
-                       "mod_cookie2json: ap_pass_brigade failed for %s", r->uri );
-        return HTTP_INTERNAL_SERVER_ERROR;
+    if( plan->header_name || plan->placeholder_len ) {
+        ap_add_output_filter( INJECT_FILTER, NULL, r, r->connection );
     }
-
-    return OK;
 }
 
 /* ********************************************
@@ -451,14 +2142,109 @@ static void *init_settings(apr_pool_t *p, char *d)
     settings_rec *cfg;
 
     cfg = (settings_rec *) apr_pcalloc(p, sizeof(settings_rec));
-    cfg->enabled                    = 0;
-    cfg->callback_name_from         = "";
+    cfg->enabled                    = UNSET;
+    cfg->decode_values              = UNSET;
+    cfg->early                      = UNSET;
+    cfg->callback_name_from         = NULL;
+    cfg->keys_from                  = NULL;
+    cfg->header_name                = NULL;
+    cfg->placeholder                = NULL;
+    cfg->cache_ttl                  = UNSET;
+    cfg->etag                       = UNSET;
+    cfg->max_age                    = UNSET;
+    cfg->vary_cookie                = UNSET;
+    cfg->timings                    = UNSET;
+    cfg->server_timing              = UNSET;
+    cfg->max_cookies                = UNSET;
+    cfg->max_header_bytes           = UNSET;
+    cfg->max_response_bytes         = UNSET;
+    cfg->limit_action               = UNSET;
+    cfg->duplicates                 = UNSET;
+    cfg->format                     = UNSET;
+    cfg->set_env                    = UNSET;
     cfg->cookie_prefix              = apr_array_make(p, 2, sizeof(const char*) );
+    cfg->cookie_names               = apr_array_make(p, 2, sizeof(const char*) );
     cfg->callback_prefixes          = apr_array_make(p, 2, sizeof(const char*) );
 
     return cfg;
 }
 
+/* merge the settings of a nested section (child) into its parent. Settings
+ * that aren't set in the child are inherited, and white lists are combined. */
+static void *merge_settings(apr_pool_t *p, void *parent_conf, void *child_conf)
+{
+    settings_rec *parent = (settings_rec *) parent_conf;
+    settings_rec *child  = (settings_rec *) child_conf;
+    settings_rec *cfg;
+
+    // Merging happens for every request that touches a nested section. One
+    // that doesn't set any of our directives changes nothing, so its parent
+    // (and the parent's plan) will do as it is.
+    if( !child->configured ) {
+        return parent;
+    }
+
+    cfg = (settings_rec *) apr_pcalloc(p, sizeof(settings_rec));
+    cfg->enabled            = child->enabled       != UNSET ? child->enabled       : parent->enabled;
+    cfg->decode_values      = child->decode_values != UNSET ? child->decode_values : parent->decode_values;
+    cfg->early              = child->early         != UNSET ? child->early         : parent->early;
+    cfg->callback_name_from = child->callback_name_from ? child->callback_name_from
+                                                        : parent->callback_name_from;
+    cfg->keys_from          = child->keys_from ? child->keys_from : parent->keys_from;
+    cfg->header_name        = child->header_name ? child->header_name : parent->header_name;
+    cfg->placeholder        = child->placeholder ? child->placeholder : parent->placeholder;
+    cfg->cache_ttl          = child->cache_ttl     != UNSET ? child->cache_ttl     : parent->cache_ttl;
+    cfg->etag               = child->etag          != UNSET ? child->etag          : parent->etag;
+    cfg->max_age            = child->max_age       != UNSET ? child->max_age       : parent->max_age;
+    cfg->vary_cookie        = child->vary_cookie   != UNSET ? child->vary_cookie   : parent->vary_cookie;
+    cfg->timings            = child->timings       != UNSET ? child->timings       : parent->timings;
+    cfg->server_timing      = child->server_timing != UNSET ? child->server_timing : parent->server_timing;
+    cfg->max_cookies        = child->max_cookies   != UNSET ? child->max_cookies   : parent->max_cookies;
+    cfg->max_header_bytes   = child->max_header_bytes   != UNSET ? child->max_header_bytes
+                                                             : parent->max_header_bytes;
+    cfg->max_response_bytes = child->max_response_bytes != UNSET ? child->max_response_bytes
+                                                             : parent->max_response_bytes;
+    cfg->limit_action       = child->limit_action  != UNSET ? child->limit_action  : parent->limit_action;
+    cfg->duplicates         = child->duplicates    != UNSET ? child->duplicates    : parent->duplicates;
+    cfg->format             = child->format        != UNSET ? child->format        : parent->format;
+    cfg->set_env            = child->set_env       != UNSET ? child->set_env       : parent->set_env;
+    cfg->cookie_prefix      = apr_array_append(p, parent->cookie_prefix,     child->cookie_prefix);
+    cfg->cookie_names       = apr_array_append(p, parent->cookie_names,      child->cookie_names);
+    cfg->callback_prefixes  = apr_array_append(p, parent->callback_prefixes, child->callback_prefixes);
+
+    // Don't recompile or rehash anything either: just link the compiled white
+    // lists together, and derive the fingerprint from the two plans'. They
+    // already cover the white lists of both sections.
+    const plan_t *parent_plan = parent->plan ? parent->plan : compile_settings( p, parent );
+    const plan_t *child_plan  = child->plan  ? child->plan  : compile_settings( p, child );
+
+    cfg->plan = make_plan( p, cfg,
+                    chain_matchers( p, child_plan->cookie_matchers,   parent_plan->cookie_matchers ),
+                    chain_matchers( p, child_plan->callback_matchers, parent_plan->callback_matchers ),
+                    hash_bytes( parent_plan->fingerprint, &child_plan->fingerprint,
+                                sizeof(child_plan->fingerprint) ) );
+
+    // count requests against the innermost section that has its own counters
+    cfg->configured         = child->configured;
+    cfg->plan->stats_slot   = child_plan->stats_slot ? child_plan->stats_slot
+                                                     : parent_plan->stats_slot;
+
+    return cfg;
+}
+
+/* The combined length of all the strings in a list */
+static apr_size_t list_bytes( const apr_array_header_t *list )
+{
+    apr_size_t total = 0;
+    int i;
+
+    for( i = 0; i < list->nelts; i++ ) {
+        total += strlen( ((const char **)list->elts)[i] );
+    }
+
+    return total;
+}
+
 /* Set the value of a config variabe, strings only */
 static const char *set_config_value(cmd_parms *cmd, void *mconfig,
                                     const char *value)
@@ -466,9 +2252,9 @@ static const char *set_config_value(cmd_parms *cmd, void *mconfig,
     settings_rec *cfg;
 
     cfg = (settings_rec *) mconfig;
+    cfg->configured = 1;
 
-    char name[50];
-    sprintf( name, "%s", cmd->cmd->name );
+    const char *name = cmd->cmd->name;
 
     /*
      * Apply restrictions on attributes.
@@ -477,10 +2263,33 @@ static const char *set_config_value(cmd_parms *cmd, void *mconfig,
         return apr_psprintf(cmd->pool, "%s not allowed to be NULL", name);
     }
 
+    // The compiled white lists address their states with 16 bits; that allows
+    // for a lot more prefixes than anyone would reasonably configure.
+    if( list_bytes( cfg->cookie_prefix ) + list_bytes( cfg->cookie_names ) +
+        list_bytes( cfg->callback_prefixes ) + strlen(value) > MATCHER_MAX_BYTES
+    ) {
+        return apr_psprintf(cmd->pool, "%s: too many prefixes/names configured", name);
+    }
+
     /* Use this query string argument for the cookie name */
     if( strcasecmp(name, "C2JSONCallBackNameFrom") == 0 ) {
+        // It has to be something we could find in a query string
+        if( strpbrk( value, "&=;# " ) ) {
+            return apr_psprintf(cmd->pool, "%s: '%s' is not a valid query string parameter",
+                                name, value);
+        }
+
         cfg->callback_name_from = apr_pstrdup(cmd->pool, value);
 
+    /* Use this query string argument for the list of cookies to return */
+    } else if( strcasecmp(name, "C2JSONKeysFrom") == 0 ) {
+        if( strpbrk( value, "&=;# " ) ) {
+            return apr_psprintf(cmd->pool, "%s: '%s' is not a valid query string parameter",
+                                name, value);
+        }
+
+        cfg->keys_from = apr_pstrdup(cmd->pool, value);
+
     /* all the keys that will not be put into the cookie */
     } else if( strcasecmp(name, "C2JSONPrefix") == 0 ) {
 
@@ -491,12 +2300,85 @@ static const char *set_config_value(cmd_parms *cmd, void *mconfig,
 
         _DEBUG && fprintf( stderr, "prefix white list as str = %s\n", apr_array_pstrcat( cmd->pool, cfg->cookie_prefix, '-' ) );
 
+    /* like the above, but the whole key has to match */
+    } else if( strcasecmp(name, "C2JSONName") == 0 ) {
+        const char *str                                  = apr_pstrdup(cmd->pool, value);
+        *(const char**)apr_array_push(cfg->cookie_names) = str;
+
+        _DEBUG && fprintf( stderr, "name white list as str = %s\n", apr_array_pstrcat( cmd->pool, cfg->cookie_names, '-' ) );
+
     /* callback param will be validated against this */
     } else if( strcasecmp(name, "C2JSONCallBackPrefix") == 0 ) {
         const char *str                                       = apr_pstrdup(cmd->pool, value);
         *(const char**)apr_array_push(cfg->callback_prefixes) = str;
 
         _DEBUG && fprintf( stderr, "callback prefix list as str = %s\n", apr_array_pstrcat( cmd->pool, cfg->callback_prefixes, '-' ) );
+
+    /* add the cookies to the responses of other handlers, in a header */
+    } else if( strcasecmp(name, "C2JSONHeader") == 0 ) {
+        if( strpbrk( value, "()<>@,;:\\\"/[]?={} \t" ) ) {
+            return apr_psprintf(cmd->pool, "%s: '%s' is not a valid header name",
+                                name, value);
+        }
+
+        cfg->header_name = apr_pstrdup(cmd->pool, value);
+
+    /* and/or in HTML responses, in place of this */
+    } else if( strcasecmp(name, "C2JSONPlaceholder") == 0 ) {
+        cfg->placeholder = apr_pstrdup(cmd->pool, value);
+
+    /* what to do when one of the limits is reached */
+    } else if( strcasecmp(name, "C2JSONLimitAction") == 0 ) {
+        if( strcasecmp(value, "truncate") == 0 ) {
+            cfg->limit_action = LIMIT_TRUNCATE;
+
+        } else if( strcmp(value, "400") == 0 ) {
+            cfg->limit_action = HTTP_BAD_REQUEST;
+
+        } else if( strcmp(value, "431") == 0 ) {
+            cfg->limit_action = HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE;
+
+        } else {
+            return apr_psprintf(cmd->pool, "%s must be one of truncate, 400 or 431, not '%s'",
+                                name, value);
+        }
+
+    /* what to do with cookies that are sent more than once */
+    } else if( strcasecmp(name, "C2JSONDuplicates") == 0 ) {
+        if( strcasecmp(value, "all") == 0 ) {
+            cfg->duplicates = DUPLICATES_ALL;
+
+        } else if( strcasecmp(value, "first") == 0 ) {
+            cfg->duplicates = DUPLICATES_FIRST;
+
+        } else if( strcasecmp(value, "last") == 0 ) {
+            cfg->duplicates = DUPLICATES_LAST;
+
+        } else if( strcasecmp(value, "array") == 0 ) {
+            cfg->duplicates = DUPLICATES_ARRAY;
+
+        } else {
+            return apr_psprintf(cmd->pool, "%s must be one of all, first, last or array, not '%s'",
+                                name, value);
+        }
+
+    /* the format of the response */
+    } else if( strcasecmp(name, "C2JSONFormat") == 0 ) {
+        int format;
+
+        for( format = FORMAT_JSON; format < FORMAT_AUTO; format++ ) {
+            if( strcasecmp(value, formats[format].name) == 0 ) {
+                break;
+            }
+        }
+
+        if( format == FORMAT_AUTO && strcasecmp(value, "auto") != 0 ) {
+            return apr_psprintf(cmd->pool, "%s must be one of json, msgpack, cbor or auto, not '%s'",
+                                name, value);
+        }
+
+        cfg->format = format;
+
     } else {
         return apr_psprintf(cmd->pool, "No such variable %s", name);
     }
@@ -511,13 +2393,186 @@ static const char *set_config_enable(cmd_parms *cmd, void *mconfig,
     settings_rec *cfg;
 
     cfg = (settings_rec *) mconfig;
+    cfg->configured = 1;
 
-    char name[50];
-    sprintf( name, "%s", cmd->cmd->name );
+    const char *name = cmd->cmd->name;
 
     if( strcasecmp(name, "C2JSON") == 0 ) {
         cfg->enabled           = value;
 
+    } else if( strcasecmp(name, "C2JSONDecode") == 0 ) {
+        cfg->decode_values     = value;
+
+    } else if( strcasecmp(name, "C2JSONEarly") == 0 ) {
+        const char *err;
+
+        // The quick handler only walks <Location> sections; see early_hook()
+        if( (err = ap_check_cmd_context(cmd, NOT_IN_DIRECTORY|NOT_IN_FILES)) ) {
+            return err;
+        }
+
+        cfg->early             = value;
+        early_configured      |= value;
+
+    } else if( strcasecmp(name, "C2JSONETag") == 0 ) {
+        cfg->etag              = value;
+
+    } else if( strcasecmp(name, "C2JSONVaryCookie") == 0 ) {
+        cfg->vary_cookie       = value;
+
+    } else if( strcasecmp(name, "C2JSONTimings") == 0 ) {
+        cfg->timings           = value;
+
+    } else if( strcasecmp(name, "C2JSONServerTiming") == 0 ) {
+        cfg->server_timing     = value;
+
+    } else if( strcasecmp(name, "C2JSONSetEnv") == 0 ) {
+        cfg->set_env           = value;
+
+    } else {
+        return apr_psprintf(cmd->pool, "No such variable %s", name);
+    }
+
+    return NULL;
+}
+
+/* Compile the settings of a config section, and of all the sections nested in
+ * it (<Files> and <If>), unless that was done already */
+static void compile_section(apr_pool_t *p, ap_conf_vector_t *section,
+                            const char *server_name)
+{
+    settings_rec *cfg       = ap_get_module_config( section, &cookie2json_module );
+    core_dir_config *core   = ap_get_core_module_config( section );
+    int i;
+
+    if( cfg && !cfg->plan ) {
+        cfg->plan = compile_settings( p, cfg );
+    }
+
+    // Sections that set any of our directives get their own counters, named
+    // for the status page like "localhost:80 /some/location"
+    if( cfg && cfg->configured && !cfg->plan->stats_slot ) {
+        cfg->plan->stats_slot = stats_add_slot( p,
+                                    core && core->d ? apr_pstrcat( p, server_name, " ", core->d, NULL )
+                                                    : server_name );
+    }
+
+    if( core && core->sec_file ) {
+        for( i = 0; i < core->sec_file->nelts; i++ ) {
+            compile_section( p, ((ap_conf_vector_t **)core->sec_file->elts)[i], server_name );
+        }
+    }
+
+    if( core && core->sec_if ) {
+        for( i = 0; i < core->sec_if->nelts; i++ ) {
+            compile_section( p, ((ap_conf_vector_t **)core->sec_if->elts)[i], server_name );
+        }
+    }
+}
+
+/* Once the whole config is read, compile every section that has our settings,
+ * so requests only ever deal with read only, ready to use plans. */
+static int post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp,
+                       server_rec *s)
+{
+    server_rec *main_server = s;
+    int i;
+
+    for( ; s; s = s->next ) {
+        core_server_config *sconf = ap_get_core_module_config( s->module_config );
+        const char *server_name   = apr_psprintf( pconf, "%s:%u",
+                                        s->server_hostname ? s->server_hostname : "*",
+                                        (unsigned) s->port );
+
+        compile_section( pconf, s->lookup_defaults, server_name );
+
+        for( i = 0; sconf->sec_dir && i < sconf->sec_dir->nelts; i++ ) {
+            compile_section( pconf, ((ap_conf_vector_t **)sconf->sec_dir->elts)[i], server_name );
+        }
+
+        for( i = 0; sconf->sec_url && i < sconf->sec_url->nelts; i++ ) {
+            compile_section( pconf, ((ap_conf_vector_t **)sconf->sec_url->elts)[i], server_name );
+        }
+    }
+
+    if( cache_create( pconf, main_server ) != APR_SUCCESS ||
+        stats_create( pconf, main_server ) != APR_SUCCESS
+    ) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return OK;
+}
+
+/* Set the value of a config variable, numbers only */
+static const char *set_config_number(cmd_parms *cmd, void *mconfig,
+                                     const char *value)
+{
+    settings_rec *cfg;
+
+    cfg = (settings_rec *) mconfig;
+
+    const char *name = cmd->cmd->name;
+    const char *err;
+    char *end;
+
+    apr_int64_t number = apr_strtoi64( value, &end, 10 );
+
+    if( end == value || *end || number < 0 || number > APR_INT32_MAX ) {
+        // 0 means something else for the others (MaxAge, CacheTTL, ...)
+        int limit = strncasecmp( name, "C2JSONMax", CONST_LEN("C2JSONMax") ) == 0 &&
+                    strcasecmp( name, "C2JSONMaxAge" ) != 0;
+
+        return apr_psprintf(cmd->pool, "%s must be a non-negative number%s, not '%s'",
+                            name, limit ? " (0 = unlimited)" : "", value);
+    }
+
+    if( strcasecmp(name, "C2JSONCacheTTL") == 0 ) {
+        cfg->cache_ttl  = (int) number;
+        cfg->configured = 1;
+
+    } else if( strcasecmp(name, "C2JSONMaxAge") == 0 ) {
+        cfg->max_age    = (int) number;
+        cfg->configured = 1;
+
+    } else if( strcasecmp(name, "C2JSONMaxCookies") == 0 ) {
+        cfg->max_cookies        = (int) number;
+        cfg->configured         = 1;
+
+    } else if( strcasecmp(name, "C2JSONMaxHeaderBytes") == 0 ) {
+        cfg->max_header_bytes   = (int) number;
+        cfg->configured         = 1;
+
+    } else if( strcasecmp(name, "C2JSONMaxResponseBytes") == 0 ) {
+        cfg->max_response_bytes = (int) number;
+        cfg->configured         = 1;
+
+    /* The cache is shared by the whole server, so these are global */
+    } else if( strcasecmp(name, "C2JSONCacheEntries") == 0 ) {
+        if( (err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) ) {
+            return err;
+        }
+
+        cache.entries = (apr_size_t) number;
+
+    } else if( strcasecmp(name, "C2JSONCacheEntrySize") == 0 ) {
+        if( (err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) ) {
+            return err;
+        }
+
+        if( number < 16 ) {
+            return apr_psprintf(cmd->pool, "%s must be at least 16", name);
+        }
+
+        cache.entry_size = (apr_size_t) number;
+
+    } else if( strcasecmp(name, "C2JSONScratchSize") == 0 ) {
+        if( (err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) ) {
+            return err;
+        }
+
+        scratch_size = (apr_size_t) number;
+
     } else {
         return apr_psprintf(cmd->pool, "No such variable %s", name);
     }
@@ -534,12 +2589,57 @@ static const char *set_config_enable(cmd_parms *cmd, void *mconfig,
 static const command_rec commands[] = {
     AP_INIT_FLAG( "C2JSON",                     set_config_enable,  NULL, OR_FILEINFO,
                   "whether or not to enable querystring to cookie module"),
+    AP_INIT_FLAG( "C2JSONEarly",                set_config_enable,  NULL, ACCESS_CONF|RSRC_CONF,
+                  "whether or not to answer before the rest of the request pipeline runs"),
+    AP_INIT_FLAG( "C2JSONDecode",               set_config_enable,  NULL, OR_FILEINFO,
+                  "whether or not to URL decode cookie values before returning them"),
     AP_INIT_TAKE1("C2JSONCallBackNameFrom",     set_config_value,   NULL, OR_FILEINFO,
                   "the callback name will come from this query paramater"),
+    AP_INIT_TAKE1("C2JSONKeysFrom",             set_config_value,   NULL, OR_FILEINFO,
+                  "only return the cookies listed in this query parameter"),
+    AP_INIT_TAKE1("C2JSONHeader",               set_config_value,   NULL, OR_FILEINFO,
+                  "add the cookies to the responses of other handlers in this header"),
+    AP_INIT_TAKE1("C2JSONPlaceholder",          set_config_value,   NULL, OR_FILEINFO,
+                  "put the cookies in place of this string in HTML responses"),
     AP_INIT_ITERATE("C2JSONCallBackPrefix",     set_config_value,   NULL, OR_FILEINFO,
                   "the callback name will be validated against these prefixes"),
     AP_INIT_ITERATE("C2JSONPrefix",             set_config_value,   NULL, OR_FILEINFO,
                   "only cookies whose key matches these prefixes will be returned" ),
+    AP_INIT_ITERATE("C2JSONName",               set_config_value,   NULL, OR_FILEINFO,
+                  "cookies whose key is exactly one of these names will also be returned" ),
+    AP_INIT_FLAG( "C2JSONETag",                 set_config_enable,  NULL, OR_FILEINFO,
+                  "whether or not to send an ETag and answer If-None-Match with a 304"),
+    AP_INIT_TAKE1("C2JSONMaxAge",               set_config_number,  NULL, OR_FILEINFO,
+                  "let browsers cache the response for this many seconds" ),
+    AP_INIT_FLAG( "C2JSONVaryCookie",           set_config_enable,  NULL, OR_FILEINFO,
+                  "whether or not to send a 'Vary: Cookie' header"),
+    AP_INIT_FLAG( "C2JSONTimings",              set_config_enable,  NULL, OR_FILEINFO,
+                  "whether or not to time every request, for logging"),
+    AP_INIT_FLAG( "C2JSONServerTiming",         set_config_enable,  NULL, OR_FILEINFO,
+                  "whether or not to send the timings in a Server-Timing header"),
+
+    AP_INIT_FLAG( "C2JSONSetEnv",               set_config_enable,  NULL, OR_FILEINFO,
+                  "whether or not to put the cookies in the environment, as C2JSON_<name>"),
+    AP_INIT_TAKE1("C2JSONDuplicates",           set_config_value,   NULL, OR_FILEINFO,
+                  "what to do with cookies sent more than once: all, first, last or array" ),
+    AP_INIT_TAKE1("C2JSONFormat",               set_config_value,   NULL, OR_FILEINFO,
+                  "the response format: json, msgpack, cbor or auto to follow the Accept header" ),
+    AP_INIT_TAKE1("C2JSONMaxCookies",           set_config_number,  NULL, OR_FILEINFO,
+                  "only look at this many cookies; 0 for no limit" ),
+    AP_INIT_TAKE1("C2JSONMaxHeaderBytes",       set_config_number,  NULL, OR_FILEINFO,
+                  "only look at this many bytes of the Cookie header; 0 for no limit" ),
+    AP_INIT_TAKE1("C2JSONMaxResponseBytes",     set_config_number,  NULL, OR_FILEINFO,
+                  "never send a response larger than this; 0 for no limit" ),
+    AP_INIT_TAKE1("C2JSONLimitAction",          set_config_value,   NULL, OR_FILEINFO,
+                  "what to do when a limit is reached: truncate, 400 or 431" ),
+    AP_INIT_TAKE1("C2JSONCacheTTL",             set_config_number,  NULL, OR_FILEINFO,
+                  "cache responses for this many seconds; 0 disables caching" ),
+    AP_INIT_TAKE1("C2JSONCacheEntries",         set_config_number,  NULL, RSRC_CONF,
+                  "the number of responses the shared response cache can hold" ),
+    AP_INIT_TAKE1("C2JSONCacheEntrySize",       set_config_number,  NULL, RSRC_CONF,
+                  "the largest response (in bytes) the response cache will store" ),
+    AP_INIT_TAKE1("C2JSONScratchSize",          set_config_number,  NULL, RSRC_CONF,
+                  "bytes of working memory kept per connection; 0 uses the request pool" ),
     {NULL}
 };
 
@@ -552,13 +2652,35 @@ static const command_rec commands[] = {
 static void register_hooks(apr_pool_t *p)
 {   // Because this is a /handler/, be sure to use ap_hook_handler, and not
     // ap_hook_fixups: http://www.apachetutor.org/dev/request
+    ap_hook_handler( status_hook, NULL, NULL, APR_HOOK_MIDDLE );
     ap_hook_handler( hook, NULL, NULL, APR_HOOK_MIDDLE );
+
+    // For C2JSONEarly; see early_hook()
+    ap_hook_quick_handler( early_hook, NULL, NULL, APR_HOOK_MIDDLE );
+
+    // For C2JSONHeader & C2JSONPlaceholder; see inject_filter(). This runs
+    // before mod_deflate & co get to compress the page.
+    ap_register_output_filter( INJECT_FILTER, inject_filter, NULL, AP_FTYPE_RESOURCE );
+    ap_hook_insert_filter( insert_filter, NULL, NULL, APR_HOOK_MIDDLE );
+
+    // The cookies for other modules; see mod_cookie2json.h & C2JSONSetEnv
+    APR_REGISTER_OPTIONAL_FN( c2json_cookies );
+    APR_REGISTER_OPTIONAL_FN( c2json_cookie_get );
+    ap_hook_optional_fn_retrieve( retrieve_optional_fn, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_fixups( set_env_hook, NULL, NULL, APR_HOOK_MIDDLE );
+
+    ap_hook_pre_config( pre_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_post_config( post_config, NULL, NULL, APR_HOOK_MIDDLE );
+
+    // Done here, rather than in a hook, so it's in place before the children
+    // are forked or any threads are started.
+    select_scanners();
 }
 
 module AP_MODULE_DECLARE_DATA cookie2json_module = {
     STANDARD20_MODULE_STUFF,
     init_settings,              /* dir config creator */
-    NULL,                       /* dir merger --- default is to override */
+    merge_settings,             /* dir merger */
     NULL,                       /* server config */
     NULL,                       /* merge server configs */
     commands,                   /* command apr_table_t */
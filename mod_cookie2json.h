@@ -0,0 +1,64 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The cookies of a request, as parsed by mod_cookie2json, for other modules.
+ *
+ * The Cookie header is parsed once per request, the first time any of these
+ * is called (or when mod_cookie2json needs it itself), and the result is kept
+ * with the request. The cookies are the ones on the white list set by
+ * C2JSONPrefix / C2JSONName, if there is one, URL decoded with C2JSONDecode,
+ * and cut short by the C2JSONMax* limits, exactly like in the JSON responses.
+ * For a cookie that was sent more than once, the value is the first one, or
+ * the last one with 'C2JSONDuplicates last'.
+ *
+ * The settings that apply are the ones of the request at the time of the
+ * first call, so call these from the fixups hook or later to get those of
+ * the <Location> etc. of the request.
+ *
+ * These are optional functions; mod_cookie2json doesn't have to be loaded:
+ *
+ *   #include "mod_cookie2json.h"
+ *
+ *   static APR_OPTIONAL_FN_TYPE(c2json_cookie_get) *cookie_get;
+ *
+ *   static void retrieve_optional_fn(void)
+ *   {
+ *       cookie_get = APR_RETRIEVE_OPTIONAL_FN(c2json_cookie_get);
+ *   }
+ *
+ *   // and in register_hooks():
+ *   ap_hook_optional_fn_retrieve(retrieve_optional_fn, NULL, NULL, APR_HOOK_MIDDLE);
+ *
+ *   // and then, while handling a request:
+ *   const char *session = cookie_get ? cookie_get(r, "session") : NULL;
+ */
+
+#ifndef MOD_COOKIE2JSON_H
+#define MOD_COOKIE2JSON_H
+
+#include "httpd.h"
+#include "apr_hash.h"
+#include "apr_optional.h"
+
+/* All of the cookies: a hash of names to NUL terminated values, from the
+ * request pool. Look them up with APR_HASH_KEY_STRING. Don't modify it. */
+APR_DECLARE_OPTIONAL_FN(apr_hash_t *, c2json_cookies, (request_rec *r));
+
+/* The value of a single cookie, or NULL if there is no such cookie */
+APR_DECLARE_OPTIONAL_FN(const char *, c2json_cookie_get, (request_rec *r,
+                                                          const char *name));
+
+#endif /* MOD_COOKIE2JSON_H */
@@ -34,6 +34,18 @@ my %Map     = (
     ### straight forward conversion
     basic       => { },
 
+    ### keys & values are escaped to produce valid JSON
+    "basic/escaped" => {
+        cookies => [ Cookie => 'a=x"y; b\\=z\\; c=1' . "\t" . '2' ],
+        tests   => [ '{ "a": "x\\"y", "b\\\\": "z\\\\", "c": "1\\t2" }' ],
+    },
+
+    ### values are URL decoded before they are escaped
+    decode => {
+        cookies => [ Cookie => 'a=hello%20world; b=%22q%22; c=100%; d=%zz' ],
+        tests   => [ '{ "a": "hello world", "b": "\\"q\\"", "c": "100%", "d": "%zz" }' ],
+    },
+
     ### callback
     callback    => {
         query_string    => "foo=bar&callback=obj.cb&baz=zot",
@@ -45,6 +57,19 @@ my %Map     = (
         ],
     },
 
+    ### a parameter without a value before the callback; this used to stop
+    ### the callback from being found
+    "callback/after_garbage" => {
+        query_string    => "foo&callback=cb",
+        tests           => [ qr/^cb\({\n/ ],
+    },
+
+    ### the callback is percent-decoded before it's validated
+    "callback/encoded" => {
+        query_string    => "callback=obj%2Ecb",
+        tests           => [ qr/^obj\.cb\({\n/ ],
+    },
+
     ### callback missing the callback parameter
     ### this should NOT return a jsonp callback
     "callback/missing_query_string" => { },
@@ -132,6 +157,283 @@ my %Map     = (
         tests   => [ '{ "a": "1", "b": "2" }' ],
     },
 
+    ### nested location - inherits the 'a' and 'b' prefixes, adds 'c';
+    ### anything else is still left out
+    "whitelist/nested" => {
+        cookies => [ Cookie => 'a=1; b=2; c=3; x=9; cd=4' ],
+        tests   => [ $DefaultBody ],
+    },
+
+    ### whitelist - prefix 'a' plus the exact name 'c', regardless of case
+    whitelist_name => {
+        cookies => [ Cookie => 'a=1; ab=2; c=3; cd=4; C=5' ],
+        tests   => [ '{ "a": "1", "ab": "2", "c": "3", "C": "5" }' ],
+    },
+
+    ### cookies sent more than once
+    duplicates => {
+        cookies => [ Cookie => 'a=1; b=2; a=3' ],
+        tests   => [ '{ "a": "1", "b": "2" }' ],
+    },
+
+    "duplicates/last" => {
+        cookies => [ Cookie => 'a=1; b=2; a=3' ],
+        tests   => [ '{ "a": "3", "b": "2" }' ],
+    },
+
+    "duplicates/array" => {
+        cookies => [ Cookie => 'a=1; b=2; a=3' ],
+        tests   => [ '{ "a": [ "1", "3" ], "b": "2" }' ],
+    },
+
+    ### answered from the quick handler; the same config still applies, and
+    ### output filters still run
+    early => {
+        query_string    => "callback=cb",
+        tests           => [
+            qr/^cb\({\n/,
+            qr/body: { "a": "1", "b": "2" }\n/,
+            sub {
+                my $res     = shift;
+                my @header  = $res->header( 'X-C2JSON-Header' );
+
+                is( scalar(@header), 1,         "  Found header: @header" );
+                is( $header[0],      "Early",   "    Header as expected: @header" );
+            },
+        ],
+    },
+
+    ### responses are cached; asking again gives the same answer, from the
+    ### cache, and different cookies don't get the cached answer
+    cache => {
+        tests   => [
+            $DefaultBody,
+            sub {
+                my $ua  = LWP::UserAgent->new();
+                my $url = "$Base/cache";
+
+                ### the counter on the status page, for /cache only
+                my $hits = sub {
+                    my $status = $ua->get( "$Base/c2json-status?auto" )->content;
+                    return $status =~ /^Location: \S+ \/cache\n(?:\w+: [^\n]*\n)*?CacheHits: (\d+)$/m
+                                ? $1 : undef;
+                };
+
+                my $before = $hits->();
+                ok( defined $before,            "  Found the cache hits" );
+
+                is( $ua->get( $url, @$DefaultCookies )->content, $DefaultBody,
+                                                "  Cached body as expected" );
+
+                my $after = $hits->();
+                ok( defined $after && $after > $before,
+                                                "  Answered from the cache" );
+
+                is( $ua->get( $url, Cookie => 'a=2' )->content, '{ "a": "2" }',
+                                                "  Other cookies not cached" );
+            },
+        ],
+    },
+
+    ### a location that only differs in its limits has its own responses,
+    ### even when its parent has the same cookies cached already
+    "cache/limited" => {
+        tests   => [
+            '{ "a": "1", "b": "2" }',
+            sub {
+                my $ua  = LWP::UserAgent->new();
+
+                is( $ua->get( "$Base/cache", @$DefaultCookies )->content, $DefaultBody,
+                                                "  Parent body as expected" );
+                is( $ua->get( "$Base/cache/limited", @$DefaultCookies )->content,
+                    '{ "a": "1", "b": "2" }',   "  Limited body as expected" );
+            },
+        ],
+    },
+
+    ### the counters; by now /basic has been requested (the tests run
+    ### in alphabetical order)
+    "c2json-status" => {
+        query_string    => "auto",
+        content_type    => "text/plain; charset=ISO-8859-1",
+        tests           => [
+            qr/^Location: \S+ \/basic\nRequests: [1-9]\d*\nJSON: [1-9]/m,
+            qr/^Latency: \d+(,\d+){15}$/m,
+        ],
+    },
+
+    ### validators & caching headers; sending the ETag back gives a 304
+    etag => {
+        tests   => [
+            $DefaultBody,
+            sub {
+                my $res     = shift;
+                my $etag    = $res->header( 'ETag' );
+
+                like( $etag, qr/^"[0-9a-f]{16}"$/,  "  Found ETag: $etag" );
+                is( $res->header( 'Cache-Control' ), "private, max-age=60",
+                                                    "    Cache-Control as expected" );
+                like( $res->header( 'Vary' ), qr/Cookie/,
+                                                    "    Vary as expected" );
+
+                my $ua  = LWP::UserAgent->new();
+                my $url = "$Base/etag";
+
+                is( $ua->get( $url, @$DefaultCookies, 'If-None-Match' => $etag )->code,
+                    304,                            "  If-None-Match gives a 304" );
+                is( $ua->get( $url, Cookie => 'a=2', 'If-None-Match' => $etag )->code,
+                    200,                            "  Other cookies give a 200" );
+            },
+        ],
+    },
+
+    ### a key with several values doesn't get the ETag of several keys
+    ### with the same strings in them
+    "etag/array" => {
+        cookies => [ Cookie => 'a=1; a=2; a=3' ],
+        tests   => [
+            '{ "a": [ "1", "2", "3" ] }',
+            sub {
+                my $res     = shift;
+                my $etag    = $res->header( 'ETag' );
+                my $ua      = LWP::UserAgent->new();
+                my $other   = $ua->get( "$Base/etag/array", Cookie => 'a=1; 2=3',
+                                        'If-None-Match' => $etag );
+
+                is( $other->code,    200,                       "  Other cookies give a 200" );
+                is( $other->content, '{ "a": "1", "2": "3" }',  "    Body as expected" );
+            },
+        ],
+    },
+
+    ### the same map in binary formats, picked by a directive...
+    format => {
+        content_type    => "application/msgpack",
+        tests           => [ "\x83\xa1a\xa11\xa1b\xa12\xa1c\xa13" ],
+    },
+
+    "format/cbor" => {
+        content_type    => "application/cbor",
+        tests           => [ "\xa3\x61a\x611\x61b\x612\x61c\x613" ],
+    },
+
+    ### ... or by the Accept header; without one, it's JSON
+    "format/auto" => {
+        headers         => [ Accept => 'application/cbor, */*;q=0.5' ],
+        content_type    => "application/cbor",
+        tests           => [
+            "\xa3\x61a\x611\x61b\x612\x61c\x613",
+            sub {
+                my $res     = shift;
+
+                like( $res->header( 'Vary' ), qr/Accept/,   "  Vary as expected" );
+
+                my $ua  = LWP::UserAgent->new();
+                is( $ua->get( "$Base/format/auto", @$DefaultCookies )->content,
+                    $DefaultBody,                           "  JSON without Accept" );
+            },
+        ],
+    },
+
+    ### added to a proxied page, in a header and in place of a placeholder
+    inject => {
+        content_type    => "text/html",
+        tests           => [
+            "<script>var c = $DefaultBody;</script>",
+            sub {
+                my $res     = shift;
+
+                is( $res->header( 'X-C2JSON-Cookies' ), $DefaultBody,
+                                                    "  Header as expected" );
+                like( $res->header( 'Vary' ), qr/\bCookie\b/,
+                                                    "  Varies by cookie" );
+                is( $res->header( 'Cache-Control' ), 'private',
+                                                    "  Private response" );
+            },
+        ],
+    },
+
+    ### which can't be used to break out of the <script>
+    "inject/escaped" => {
+        cookies         => [ Cookie => 'a=</script>&' ],
+        content_type    => "text/html",
+        tests           => [ '<script>var c = { "a": "\u003c/script\u003e\u0026" };</script>' ],
+    },
+
+    ### or in the environment, for the backend to use. That goes through
+    ### c2json_cookies() and c2json_cookie_get(), the functions for other
+    ### modules; the first value of a cookie sent twice wins
+    "env/200" => {
+        cookies         => [ Cookie => 'a=1; b=2; a=3' ],
+        tests           => [
+            '',
+            sub {
+                my $res     = shift;
+
+                is( $res->header( 'X-C2JSON-a' ), '1', "  Environment as expected" );
+                is( $res->header( 'X-C2JSON-b' ), '2', "    For every cookie" );
+            },
+        ],
+    },
+
+    ### only the cookies asked for, if they're on the white list
+    keys => {
+        query_string    => "keys=b,c",
+        tests           => [ '{ "b": "2" }' ],
+    },
+
+    ### the callback and the keys come from the same query string
+    "keys/callback" => {
+        query_string    => "callback=cb&foo=bar&keys=a",
+        tests           => [
+            qr/^cb\({\n/,
+            qr/body: { "a": "1" }\n/,
+        ],
+    },
+
+    ### limits on the work per request; cookies past the limit are left out
+    limit => {
+        tests   => [ '{ "a": "1", "b": "2" }' ],
+    },
+
+    ### or the request is refused
+    "limit/431" => {
+        content_type => 'text/html; charset=iso-8859-1',
+        status       => 431,
+        tests        => [ qr/Request Header Fields Too Large/ ],
+    },
+
+    ### a cookie that straddles the limit is left out entirely
+    "limit/header_bytes" => {
+        tests   => [ '{ "a": "1", "b": "2" }' ],
+    },
+
+    "limit/response_bytes" => {
+        tests   => [ '{ "a": "1" }' ],
+    },
+
+    ### a callback too long for even an empty response can't be truncated
+    "limit/response_bytes/callback" => {
+        query_string => 'callback=a_callback_that_is_too_long',
+        content_type => 'text/html; charset=iso-8859-1',
+        status       => 400,
+        tests        => [ 'Bad Request' ],
+    },
+
+    ### per request timings, sent back in a Server-Timing header
+    timings => {
+        tests   => [
+            $DefaultBody,
+            sub {
+                my $res     = shift;
+                my $timing  = $res->header( 'Server-Timing' ) || '';
+
+                like( $timing, qr/^c2json-callback;dur=\d+\.\d{3}, c2json-parse;dur=\d+\.\d{3}, c2json-filter;dur=\d+\.\d{3}, c2json-emit;dur=\d+\.\d{3}$/,
+                                                    "  Found Server-Timing: $timing" );
+            },
+        ],
+    },
+
     ### There was a bug that stopped headers from being set
     ### using the "Header" directive when C2JSON was enabled.
     ### Check for that here
@@ -7,6 +7,13 @@ http.createServer(function(request, response) {
   U.debug( U.inspect( request.url ) );
   U.debug( U.inspect( request.headers ) ); 
 
+  // a page to put the cookies in?
+  if( request.url.match(/^\/inject/) ) {
+    response.writeHead(200, { "Content-Type": "text/html" });
+    response.end("<script>var c = <!--C2JSON-->;</script>");
+    return;
+  }
+
   // different response code?
   var m = request.url.match(/^\/(\d+)/);
   var r = m && m[0] ? m[1] : 204;